@@ -0,0 +1,104 @@
+#pragma once
+
+#include <Arduino.h>
+#include "hardware/clocks.h"
+#include "hardware/vreg.h"
+
+#include <Machine.hpp>
+#include <Tachometer.hpp>
+
+
+#define CLOCK_PROFILES_MAX_NOMINAL_KHZ 133000         // Fastest clock the core runs at without raising its voltage
+#define CLOCK_PROFILES_BOOST_VOLTAGE VREG_VOLTAGE_1_15  // Core voltage above that
+#define CLOCK_PROFILES_VREG_SETTLE 1000               // Microseconds allowed for the voltage to settle before speeding up
+#define CLOCK_PROFILES_HYSTERESIS 0.8                 // Fraction of the high speed threshold the spindle must drop below to leave it
+
+
+typedef enum : uint8_t {
+  ClockIdle,
+  ClockNominal,
+  ClockHighSpeed,
+  ClockProfileCount,
+} ClockProfile;
+
+
+typedef struct {
+  MachineLeadscrew &leadscrew;
+  Machine::SpindleEncoder &encoder;
+  Machine::FeedbackEncoder *feedback;   // nullptr if not fitted
+  QuadratureEncoder *handwheel;         // nullptr if not fitted
+  Tachometer &tachometer;
+
+  bool automatic;                   // Pick the profile from the leadscrew and the spindle speed
+  uint32_t khz[ClockProfileCount];  // System clock of each profile
+  float highSpeedRPM;               // Spindle speed from which the high speed profile is used
+  uint32_t idleDelay;               // Seconds at rest before dropping to the idle profile
+} ClockProfilesSetup;
+
+
+/**
+ * @brief Runs the system clock slowly while the machine is at rest
+ *        and fast while the spindle is turning quickly, for more step
+ *        rate headroom when it counts.
+ *
+ * The clock is only changed while nothing is being stepped, since
+ * the core briefly runs from the reference clock as the PLL relocks.
+ * The peripheral clock is kept on the USB PLL, so the encoder's SPI
+ * rate does not depend on the profile, and everything that does is
+ * re-timed after each change, with the encoder paused meanwhile. The
+ * timers count microseconds from the reference clock and are not
+ * affected.
+ */
+class ClockProfiles {
+public:
+  ClockProfiles(ClockProfilesSetup setup) : _setup(setup) {}
+
+  void begin();
+
+  /**
+   * @brief Picks and applies the profile. Must be called from the
+   *        main loop.
+   */
+  void loop();
+
+  /**
+   * @brief Hold the given profile instead of picking one. It is
+   *        applied as soon as nothing is moving.
+   */
+  void force(ClockProfile profile);
+  void automatic();
+
+  inline ClockProfile profile() {
+    return _profile;
+  }
+
+  inline bool forced() {
+    return !_setup.automatic;
+  }
+
+  inline uint32_t switches() {
+    return _switches;
+  }
+
+  inline uint32_t failures() {
+    return _failures;
+  }
+
+  inline ClockProfilesSetup &setup() {
+    return _setup;
+  }
+
+protected:
+  ClockProfilesSetup _setup;
+
+  ClockProfile _profile = ClockNominal;
+  ClockProfile _forced = ClockNominal;
+  absolute_time_t _restTime = 0;    // Time the machine last did anything
+  uint32_t _switches = 0;
+  uint32_t _failures = 0;
+
+  ClockProfile _target();
+  bool _quiet();
+  bool _apply(ClockProfile profile);
+  void _retime(float factor);
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <Arduino.h>
+#include <array>
 
 
 // #define SIMULATE_ENCODER // Comment out to use the actual encoder
@@ -14,14 +15,62 @@ struct {
                                                           // For SPI0, the pins are 16 and 18. For SPI1, the pins are 10 and 11.
   uint32_t   EncoderClockSpeed                = 6000000;  // 6MHz
   uint8_t    EncoderResolutionBits            =      12;  // 12-bit resolution
-  float      EncoderStepsPerRevolution        =    1024;  // 1024 steps per revolution
+  float      EncoderStepsPerRevolution        =    4096;  // counts per revolution; must be 2 to the resolution bits, checked on booting
   uint32_t   EncoderUpdateInterval            =      10;  // poll interval in microseconds
+  uint32_t   EncoderIdleUpdateInterval        =    1000;  // poll interval in microseconds while the spindle is stopped
+  uint32_t   EncoderSlowDownDelay             =     100;  // time in milliseconds before the poll interval is lengthened
+  uint32_t   EncoderCountsPerSample           =       4;  // counts per sample aimed for while disengaged
+  uint8_t    EncoderFrameBits                 =      24;  // gray coded position bits per SSI frame, multi-turn included
+  bool       EncoderMultiTurn                 =   false;  // the frame bits above the resolution count turns; set to decode them
+  uint8_t    EncoderStatusBits                =       0;  // status bits following the position, parity included
+  uint32_t   EncoderStatusErrorMask           =       0;  // status bits that flag an error when set
+  bool       EncoderParity                    =   false;  // the last status bit is even parity over the frame
+  float      EncoderMaxSpeed                  =    4000;  // fastest possible spindle speed in RPM; faster looking frames are rejected
+  uint32_t   EncoderMaxRetries                =       1;  // frames read again after a bad one before the position is held
+  uint32_t   EncoderRetryDelay                =      10;  // microseconds before reading again after a bad frame
+  uint32_t   EncoderMaxHeldSamples            =      20;  // held samples in a row after which the leadscrew faults
+  const char* EncoderCorrectionPath           = "/encoder.cal";  // LittleFS file holding the learned correction table
+  uint32_t   EncoderCalibrationRevolutions    =      50;  // revolutions learned from by default, at constant speed
 
   // Stepper setup
 
   pin_size_t StepperDirectionPin              =      22;
   pin_size_t StepperPulsePin                  =      21;
   float      StepperStepsPerRevolution        =    2400;   // 2,400 steps per revolution
+  uint32_t   StepperBacklash                  =       0;   // Steps of lost motion in the leadscrew drive, taken up on every reversal
+
+  // Feedback encoder setup (closed loop)
+
+  bool       FeedbackEnabled                  =   false;   // Set when a motor shaft encoder or carriage scale is fitted
+  pin_size_t FeedbackPinA                     =      12;   // Phase A; phase B must be on the next pin
+  float      FeedbackCountsPerRevolution      =    4000;   // Feedback counts per stepper revolution (1000 lines, x4)
+  bool       FeedbackOnMotor                  =    true;   // Set for a motor shaft encoder, clear for a carriage scale
+  uint32_t   FeedbackMaxCountRate             =       0;   // Highest expected count rate, used to filter glitches; 0 to disable
+  float      FeedbackDeadband                 =      12;   // Position errors up to this many steps are not corrected
+  float      FeedbackMaxCorrection            =      24;   // Largest number of steps re-issued by a single correction
+  float      FeedbackCorrectionRate           =    2000;   // Most steps re-issued per second, however many corrections they take
+  uint32_t   FeedbackLag                      =    2000;   // Microseconds the feedback may trail the step pulses by; missing steps within it are in flight, not lost
+  float      FeedbackTolerance                =     240;   // Following error in steps beyond which the leadscrew disengages
+  uint32_t   FeedbackSimulatorMaxStepRate     =   50000;   // Simulated motor loses steps above this rate
+  uint32_t   FeedbackSimulatorBacklash        =       0;   // Simulated lost motion in steps; the simulator then acts as a carriage scale
+  uint32_t   FeedbackSimulatorLag             =    1000;   // Microseconds the simulated count trails the step pulses by
+
+  // Handwheel setup (manual pulse generator for jogging)
+
+  bool       HandwheelEnabled                 =   false;   // Set when a quadrature handwheel is fitted
+  pin_size_t HandwheelPinA                    =       6;   // Phase A; phase B must be on the next pin
+  uint32_t   HandwheelMaxCountRate            =       0;   // Highest expected count rate, used to filter glitches; 0 to disable
+  float      HandwheelCountsPerDetent         =       4;   // Quadrature counts per click of the wheel
+  float      HandwheelResolution              =  0.0001;   // Inches moved per detent at x1
+  float      HandwheelFastRate                =      10;   // Detents per second above which each detent moves further
+  float      HandwheelMaxScale                =       5;   // Most a detent is scaled up by when the wheel is spun fast
+  float      HandwheelMaxLag                  =    0.05;   // Inches the carriage may trail the wheel by
+
+  // Emergency stop setup
+
+  bool       EStopEnabled                     =   false;   // Set when an emergency stop or feed hold switch is wired
+  pin_size_t EStopPin                         =      15;   // Pulled up; the switch connects it to ground
+  bool       EStopTripHigh                    =    true;   // Trip on a high input, for a normally closed switch; clear for normally open
 
   // Display setup
 
@@ -29,8 +78,8 @@ struct {
   pin_size_t DisplayClkPin                    =      27;   // CLK pin
   pin_size_t DisplayDioPin                    =      28;   // DIO pin
 
-  std::vector<float> DisplayTPIThreads        =      { 8, 9, 10, 11, 12, 13, 14, 16, 18, 20, 24, 28, 32, 36, 40, 44, 48, 56, 64, 72, 80 };
-  std::vector<float> DisplayMetricThreads     =      { 0.2, 0.25, 0.3, 0.35, 0.4, 0.45, 0.5, 0.6, 0.7, 0.75, 0.8, 1, 1.25, 1.5, 1.75, 2, 2.5, 3 };
+  std::array<float, 21> DisplayTPIThreads     =      { 8, 9, 10, 11, 12, 13, 14, 16, 18, 20, 24, 28, 32, 36, 40, 44, 48, 56, 64, 72, 80 };
+  std::array<float, 18> DisplayMetricThreads  =      { 0.2, 0.25, 0.3, 0.35, 0.4, 0.45, 0.5, 0.6, 0.7, 0.75, 0.8, 1, 1.25, 1.5, 1.75, 2, 2.5, 3 };
 
   int        DisplayDefaultTPIThreadIndex     =       7;   // Default TPI thread index
   int        DisplayDefaultMetricThreadIndex  =       9;   // Default metric thread index
@@ -40,19 +89,64 @@ struct {
 
   float      DisplayDefaultPowerFeedIPR       =   0.005;   // Default power feed setting (in inches per revolution)
 
+  float      DisplayMinFeedIPM                =     0.1;   // Minimum feed independent of the spindle (in inches per minute)
+  float      DisplayMaxFeedIPM                =    20.0;   // Maximum feed independent of the spindle (in inches per minute)
+  float      DisplayDefaultFeedIPM            =     2.0;   // Default feed independent of the spindle (in inches per minute)
+  float      DisplayFeedStepIPM               =     0.1;   // Feed adjustment step (in inches per minute)
+  float      DisplayMinFeedMMPM               =       5;   // Minimum feed independent of the spindle (in millimetres per minute)
+  float      DisplayMaxFeedMMPM               =     500;   // Maximum feed independent of the spindle (in millimetres per minute)
+  float      DisplayDefaultFeedMMPM           =      50;   // Default feed independent of the spindle (in millimetres per minute)
+  float      DisplayFeedStepMMPM              =       5;   // Feed adjustment step (in millimetres per minute)
+
+  uint8_t    DisplayMaxStarts                 =       4;   // Largest number of starts selectable for multi-start threads
+
+  float      DisplayDefaultCycleLength        =     1.0;   // Default threading cycle pass length (in inches)
+  float      DisplayCycleStepInches           =    0.05;   // Pass length adjustment step in TPI mode (in inches)
+  float      DisplayCycleStepMillimeters      =       1;   // Pass length adjustment step in metric mode (in millimetres)
+
   bool       DisplayBanner                    =    true;   // Display banner on startup
   uint32_t   DisplayUpdateInterval            =     100;   // Update interval in milliseconds
   uint32_t   DisplayLoopInterval              =      50;   // Loop interval in milliseconds
   uint32_t   DisplayAutoOffInterval           =     600;   // Auto-off interval in seconds
   size_t     DisplayButtonQueueSize           =       3;   // Number of times the button input from the display board must be the same to be considered a valid press
+  uint32_t   DisplayMessageInterval           =    1000;   // How long short messages stay on screen in milliseconds
   
   // Lead screw setup
 
   uint8_t    LeadScrewPitch                   =       8;   // 8 TPI
   uint16_t   LeadScrewReductionFactor         =     275;   // 2.75:1 reduction factor from the stepper motor to the lead screw
+  float      LeadScrewRapidSpeed              =   20000;   // Speed of unsynchronized moves in steps per second
+  float      LeadScrewRapidAcceleration       =  100000;   // Acceleration of unsynchronized moves in steps per second squared
+  uint32_t   LeadScrewInterpolationInterval   =    2000;   // Longest time an encoder sample is spread over in microseconds; 0 to disable
+  float      LeadScrewMaxStepRate             =   50000;   // Step rate assumed until the loop has measured its own, in steps per second
+  float      LeadScrewStepRateWarning         =     0.8;   // Warn above this fraction of the maximum safe spindle speed
+  float      LeadScrewChipBreakRevolutions    =       4;   // Spindle revolutions fed between chip breaks
+  float      LeadScrewChipBreakDwell          =     0.5;   // Spindle revolutions paused for at each chip break
+  float      LeadScrewChipBreakRetract        =       0;   // Inches backed off at each chip break; 0 to only pause
 
   // Serial debug setup
 
-  uint32_t   SerialDebugUpdateInterval        =     100;   // Update interval in milliseconds
+  uint32_t   SerialDebugUpdateInterval        =     100;   // Status interval in milliseconds while watching
+
+  // Flight recorder setup
+
+  const char* FlightRecorderPath              = "/flightrec.bin";  // LittleFS file used to save a frozen recording
+  bool       FlightRecorderFreezeOnMiss       =   false;   // Freeze the recorder when an encoder sample is late
+
+  // Position checkpoint setup
+
+  bool       CheckpointEnabled                =    true;   // Keep the spindle and carriage positions, and any threading cycle, across resets and power cycles
+  const char* CheckpointPath                  = "/checkpoint.bin";  // LittleFS file holding the positions across power cycles
+  uint32_t   CheckpointInterval               =      10;   // Milliseconds between updates of the copy kept in RAM left uninitialised at boot
+  uint32_t   CheckpointSaveDelay              =    2000;   // Milliseconds the machine must be at rest before anything is saved to flash
+
+  // Clock profile setup
+
+  bool       ClockAutomatic                   =    true;   // Pick the system clock from the leadscrew and the spindle speed
+  uint32_t   ClockIdleKHz                     =   48000;   // System clock while the machine has been at rest for a while
+  uint32_t   ClockNominalKHz                  =  133000;   // System clock while working; the board's rated speed
+  uint32_t   ClockHighSpeedKHz                =  200000;   // System clock while the spindle turns fast, with the core voltage raised
+  float      ClockHighSpeedRPM                =     600;   // Spindle speed from which the high speed clock is used
+  uint32_t   ClockIdleDelay                   =      30;   // Seconds at rest before dropping to the idle clock
 
 } Config;
\ No newline at end of file
@@ -4,14 +4,36 @@
 #include <array>
 #include <TM1638.h>
 
-#include <Leadscrew.hpp>
+#include <Machine.hpp>
 #include <Tachometer.hpp>
 
 
+#define DISPLAY_MAX_JOG_MULTIPLIER 100   // Largest handwheel multiplier; the arrows step by tens while jogging
+
+
 class ImprovedTM1638: public TM1638 {
   public:
     ImprovedTM1638(uint8_t dataPin, uint8_t clockPin, uint8_t strobePin) : TM1638(dataPin, clockPin, strobePin) {}
 
+    /**
+     * @brief Override to pace the clock with a timer rather than with
+     *        the speed of the code, which follows the system clock.
+     * 
+     * @param data The byte to send
+     */
+    virtual void send(byte data) {
+      for (int i = 0; i < 8; i++) {
+        gpio_put(clockPin, 0);
+        gpio_put(dataPin, data & 1);
+        busy_wait_us(1);
+
+        data >>= 1;
+
+        gpio_put(clockPin, 1);
+        busy_wait_us(1);
+      }
+    }
+
     /**
      * @brief Override to introduce an additional delay, which is necessary for the TM1638
      *        to work properly.
@@ -53,8 +75,10 @@ typedef struct {
   uint8_t dataPin;
   uint8_t strobePin;
 
-  std::vector<float> tpiThreads;
-  std::vector<float> metricThreads;
+  const float *tpiThreads;
+  size_t tpiThreadCount;
+  const float *metricThreads;
+  size_t metricThreadCount;
 
   int defaultTPIThreadIndex;
   int defaultMetricThreadIndex;
@@ -63,8 +87,24 @@ typedef struct {
   float maxIPR;
   float defaultIPR;
 
-  Leadscrew &leadscrew;
+  float minIPM;                         // Feeds independent of the spindle, per minute
+  float maxIPM;
+  float defaultIPM;
+  float ipmStep;
+  float minMMPM;
+  float maxMMPM;
+  float defaultMMPM;
+  float mmpmStep;
+
+  uint8_t maxStarts;
+
+  float defaultCycleLength;             // Threading cycle pass length in inches
+  float cycleLengthStepInches;
+  float cycleLengthStepMillimeters;
+
+  MachineLeadscrew &leadscrew;
   Tachometer &tachometer;
+  Machine::SpindleEncoder &encoder;
 
   bool displayBanner;
   uint32_t displayUpdateIntervalMs;
@@ -72,6 +112,7 @@ typedef struct {
   size_t displayButtonQueueSize;
 
   uint32_t displayAutoOffInterval;
+  uint32_t displayMessageIntervalMs;
 } DisplaySetup;
 
 
@@ -79,6 +120,7 @@ typedef enum {
   TPI,
   Metric,
   Powerfeed,
+  FeedPerMinute,                        // Feed independent of the spindle, in inches or millimetres per minute
 } DisplayMode;
 
 
@@ -86,18 +128,40 @@ typedef enum {
   TPIMode = 0x01,
   MetricMode = 0x02,
   PowerfeedMode = 0x04,
+  MultiStart = 0x08,
   ErrorA = 0x10,
   ErrorB = 0x20,
+  Cycle = 0x40,
   Engaged = 0x80,
 } DisplayIndicators;
 
 
+/**
+ * @brief Figures shown on the diagnostics page, which is opened
+ *        and closed by pressing the TPI and Powerfeed buttons
+ *        together. The arrows step through them.
+ */
+typedef enum {
+  DiagnosticsLoopRate,          // Leadscrew loop iterations, in kHz
+  DiagnosticsLoopLatency,       // Longest gap between iterations while moving, in microseconds
+  DiagnosticsEncoderRate,       // Encoder samples, in kHz
+  DiagnosticsStepRate,          // Steps per second
+  DiagnosticsPeakStepRate,      // Highest step rate since the page was opened
+  DiagnosticsHeadroom,          // Percentage of the maximum safe spindle speed still unused
+  DiagnosticsFollowingError,    // Steps
+  DiagnosticsDeadlineMisses,
+  DiagnosticsPageCount,
+} DiagnosticsPage;
+
+
 typedef enum {
   SetTPIMode = 0x01,
   SetMetricMode = 0x02,
   SetPowerfeedMode = 0x04,
+  Starts = 0x08,
   Decrease = 0x10,
   Increase = 0x20,
+  NextStart = 0x40,
   Engage = 0x80,
 } ButtonIndices;
 
@@ -108,7 +172,7 @@ class Display {
     Display(DisplaySetup setup) : 
       _setup(setup),
       _display(setup.dataPin, setup.clockPin, setup.strobePin), _leadscrew(setup.leadscrew), 
-      _tachometer(setup.tachometer) 
+      _tachometer(setup.tachometer), _encoder(setup.encoder)
       {}
 
     void begin();
@@ -116,17 +180,48 @@ class Display {
     void mode(DisplayMode mode);
     DisplayMode mode();
 
+    /**
+     * @brief Switch to a mode with a value that need not be one
+     *        of the presets; the buttons return to the presets.
+     */
+    void threadTPI(float tpi);
+    void threadMetric(float pitch);
+    void powerFeedIPR(float feedRate);
+
+    /**
+     * @brief Switch to a feed independent of the spindle. The
+     *        direction follows the sign of the rate.
+     */
+    void feedIPM(float feedRate);
+    void feedMMPM(float feedRate);
+
+    /**
+     * @brief Hold off the buttons and the screen while the settings
+     *        are changed from the main loop. The timer runs on the
+     *        same core, so it would otherwise interleave its own
+     *        changes with them. The spindle speed is still passed on.
+     */
+    inline void hold(bool hold) {
+      _held = hold;
+    }
+
+    inline DisplaySetup &setup() {
+      return _setup;
+    }
+
   protected:
     ImprovedTM1638 _display;
     DisplaySetup _setup;
-    Leadscrew &_leadscrew;
+    MachineLeadscrew &_leadscrew;
     Tachometer &_tachometer;
+    Machine::SpindleEncoder &_encoder;
 
     repeating_timer_t _timer;
     critical_section_t _cs;
 
     uint32_t lastDisplayUpdateUs = 0;
 
+    volatile bool _held = false;
     bool _sleeping = false;
     bool _idle = false;
     uint32_t _idleStartTime = 0;
@@ -140,19 +235,70 @@ class Display {
     float _metricThread;
     float _powerFeedIPR;
 
-    std::deque<uint32_t> _buttonPressQueue;
+    float _feedIPM;
+    float _feedMMPM;
+    bool _feedMetric = false;             // Per minute feeds are shown and set in millimetres
+    int _feedDirection = 1;
 
-    absolute_time_t _lastButtonPress = 0;
+    uint32_t _buttons = 0;                // Last reading of the buttons
+    size_t _buttonReadings = 0;           // Consecutive identical readings
 
+    absolute_time_t _lastButtonPress = 0;
+    absolute_time_t _messageUntil = 0;
+
+    // Diagnostics page. Rates are worked out from the change in
+    // each counter between display updates.
+
+    bool _diagnostics = false;
+    int _diagnosticsPage = DiagnosticsLoopRate;
+    absolute_time_t _diagnosticsTime = 0;
+    uint32_t _lastWatchdog = 0;
+    uint32_t _lastSamples = 0;
+    uint32_t _lastSteps = 0;
+    float _loopRate = 0;
+    float _encoderRate = 0;
+    float _stepRate = 0;
+    float _peakStepRate = 0;
+
+    void _message(const char *text);
     void _updateIndicators();
+    void _showPitch();
     void _readButtons();
 
     void _tpiPitch(float pitch);
     void _metricPitch(float pitch);
-    void powerFeedIPR(float feedRate);
+    void _powerFeed(float feedRate);
+    void _feedPerMinute(float feedRate);
+    void _cycleFeedMode();
+    void _reverseFeed();
 
     void _increase();
     void _decrease();
+
+    void _toggleCycle();
+    void _adjustCycleLength(int direction);
+    void _updateCycle();
+
+    /**
+     * @brief Whether the mode cuts threads, which are the only
+     *        ones with starts and a threading cycle
+     */
+    inline bool _threading() {
+      return _mode == TPI || _mode == Metric;
+    }
+
+    void _cycleStarts();
+    void _nextStart();
+    void _showStart();
+
+    void _toggleChipBreaking();
+
+    void _toggleJog();
+    void _showJog();
+
+    void _toggleDiagnostics();
+    void _measureDiagnostics();
+    void _showDiagnostics(float speed);
     
     void _loop();
 };
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+typedef struct {
+  pin_size_t pin;
+  bool tripHigh;                    // Trip on a high input, as with a normally closed switch to ground
+  pin_size_t pulsePin;              // Stepper pulse output, held low while tripped
+} EmergencyStopSetup;
+
+
+/**
+ * @brief An emergency stop or feed hold input, serviced by an
+ *        interrupt on the core that runs the leadscrew loop.
+ *
+ * The interrupt overrides the stepper's pulse output to low, so no
+ * further step reaches the driver whatever the loop is doing, and
+ * latches the trip. The leadscrew loop then drops all motion and
+ * raises a fault. The trip stays latched until reset() is called
+ * with the input released, and once the loop has acknowledged it.
+ *
+ * The loop also polls the input, which backs up the interrupt and
+ * gives the last time the input was seen released. The reaction
+ * time is measured from then, so it is an upper bound that also
+ * covers the interrupt being held off by a critical section.
+ */
+class EmergencyStop {
+  friend void _emergencyStopIRQ();
+public:
+  EmergencyStop(EmergencyStopSetup setup) : _setup(setup) {}
+
+  /**
+   * @brief Must be called on the core that runs the leadscrew
+   *        loop, which is the one the interrupt is routed to
+   */
+  void begin();
+
+  inline bool tripped() {
+    return _tripped;
+  }
+
+  /**
+   * @brief Whether the loop has yet to act on the latched trip
+   */
+  inline bool pending() {
+    return _tripped && !_acknowledged;
+  }
+
+  /**
+   * @brief Called by the loop once it has dropped all motion and
+   *        raised its fault for the trip
+   */
+  void acknowledge();
+
+  /**
+   * @brief Whether the input is asking for a stop right now
+   */
+  inline bool active() {
+    return gpio_get(_setup.pin) == _setup.tripHigh;
+  }
+
+  /**
+   * @brief Called by the loop on every iteration
+   */
+  inline void poll(uint32_t now) {
+    if (!active()) {
+      _lastReleased = now;
+    } else if (!_tripped) {
+      _trip();
+    }
+  }
+
+  /**
+   * @brief Release the latch and the step output, unless the
+   *        input is still active or the loop has not acknowledged
+   *        the trip, which would otherwise go unnoticed
+   *
+   * @return Whether the trip was released
+   */
+  bool reset();
+
+  inline uint32_t trips() {
+    return _trips;
+  }
+
+  /**
+   * @brief Microseconds from the input last being seen released
+   *        to the step output being inhibited, for the last trip
+   *        and the slowest one since starting
+   */
+  inline uint32_t reactionTime() {
+    return _reactionTime;
+  }
+
+  inline uint32_t maxReactionTime() {
+    return _maxReactionTime;
+  }
+
+protected:
+  EmergencyStopSetup _setup;
+  critical_section_t _cs;
+
+  volatile bool _tripped = false;
+  volatile bool _acknowledged = false;
+  volatile uint32_t _lastReleased = 0;
+  volatile uint32_t _trips = 0;
+  volatile uint32_t _reactionTime = 0;
+  volatile uint32_t _maxReactionTime = 0;
+
+  void _trip();
+};
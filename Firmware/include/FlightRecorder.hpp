@@ -0,0 +1,138 @@
+#pragma once
+
+#include <Arduino.h>
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
+
+/**
+ * @brief Number of entries kept per core. Must be a power of two
+ *        so that the ring index can be wrapped with a mask.
+ *
+ * Steps and encoder counts are summed into at most one entry per
+ * summary interval each, so a ring holds about two seconds of
+ * motion at any speed, less what the other events take up.
+ */
+#define FLIGHT_RECORDER_CAPACITY 2048
+#define FLIGHT_RECORDER_SUMMARY_INTERVAL 1000   // Microseconds over which steps and encoder counts are summed
+
+
+typedef enum : uint8_t {
+  EventEncoderDelta,      // value: encoder counts since the previous entry
+  EventStep,              // value: net steps since the previous entry
+  EventRatio,             // fvalue: new spindle to leadscrew ratio
+  EventMode,              // value: new DisplayMode
+  EventEngage,            // value: 1 when engaged, 0 when disengaged
+  EventDeadlineMiss,      // value: actual interval between encoder samples in microseconds
+  EventFreeze,            // value: FlightRecorderFreezeReason
+  EventFault,             // value: LeadscrewFault
+  EventCorrection,        // fvalue: steps re-issued to make up a following error
+  EventStart,             // value: index of the thread start being cut
+  EventCycle,             // value: 1 when a threading cycle is armed, 0 when it ends
+  EventTakeUp,            // value: net backlash take-up steps since the previous entry
+  EventFeedRate,          // fvalue: new feed rate in steps per second, independent of the spindle
+  EventEncoderFrame,      // value: raw spindle encoder frame that was rejected
+  EventEmergencyStop,     // value: reaction time in microseconds
+  EventJog,               // value: handwheel multiplier when jogging starts or changes, 0 when it ends
+  EventChipBreak,         // value: number of chip breaks so far
+} FlightRecorderEvent;
+
+
+typedef enum : uint8_t {
+  FreezeManual,
+  FreezeButton,
+  FreezeDeadlineMiss,
+  FreezeFault,
+} FlightRecorderFreezeReason;
+
+
+struct FlightRecorderEntry {
+  uint32_t time;          // time_us_32() at which the event was recorded
+  uint8_t event;
+  uint8_t core;
+  union {
+    int32_t value;
+    float fvalue;
+  };
+};
+
+
+typedef struct {
+  const char *path;                 // LittleFS path used when saving a frozen recording
+  bool freezeOnDeadlineMiss;        // Freeze as soon as an encoder deadline is missed
+} FlightRecorderSetup;
+
+
+/**
+ * @brief An always-on, fixed-size event log kept in RAM
+ *
+ * Each core writes to its own ring so that recording an event
+ * only requires masking interrupts on the current core for a
+ * handful of instructions. Once frozen, the rings stop accepting
+ * new events and can be dumped over USB or saved to flash.
+ */
+class FlightRecorder {
+public:
+  FlightRecorder(FlightRecorderSetup setup) : _setup(setup) {}
+
+  void begin();
+
+  inline void record(FlightRecorderEvent event, int32_t value) {
+    if (_frozen) {
+      return;
+    }
+
+    const uint8_t core = get_core_num();
+    const uint32_t status = save_and_disable_interrupts();
+
+    FlightRecorderEntry &entry = _entries[core][_head[core]++ & (FLIGHT_RECORDER_CAPACITY - 1)];
+
+    entry.time = time_us_32();
+    entry.event = event;
+    entry.core = core;
+    entry.value = value;
+
+    restore_interrupts(status);
+  }
+
+  inline void record(FlightRecorderEvent event, float value) {
+    int32_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    record(event, bits);
+  }
+
+  void freeze(FlightRecorderFreezeReason reason);
+  void resume();
+
+  inline bool frozen() {
+    return _frozen;
+  }
+
+  inline FlightRecorderSetup &setup() {
+    return _setup;
+  }
+
+  inline bool freezeOnDeadlineMiss() {
+    return _setup.freezeOnDeadlineMiss;
+  }
+
+  void dump(Print &output);
+  void dumpSaved(Print &output);
+  bool save();
+
+protected:
+  FlightRecorderSetup _setup;
+
+  FlightRecorderEntry _entries[2][FLIGHT_RECORDER_CAPACITY];
+  uint32_t _head[2] = { 0, 0 };
+
+  volatile bool _frozen = false;
+  bool _saved = false;
+
+  template <typename Callback> void _forEachEntry(Callback callback);
+  void _print(Print &output, const FlightRecorderEntry &entry);
+};
+
+
+extern FlightRecorder flightRecorder;
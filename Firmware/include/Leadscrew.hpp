@@ -2,29 +2,137 @@
 
 #include <Arduino.h>
 #include <Stepper.hpp>
-#include <Encoder.hpp>
+#include <encoder.hpp>
+#include <QuadratureEncoder.hpp>
+#include <Ramp.hpp>
+#include <EmergencyStop.hpp>
 
 
+#define LEADSCREW_STEP_RATE_WINDOW 100000   // Microseconds of continuous activity per step rate measurement
+#define LEADSCREW_JOG_INTERVAL 10000        // Microseconds between readings of the handwheel while jogging
+#define LEADSCREW_FEEDBACK_HISTORY 8        // Stepper positions kept to cover the feedback lag
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
 struct LeadscrewSetup {
-  Stepper &stepper;
-  Encoder &encoder;
+  StepperT &stepper;
+  EncoderT &encoder;
 
   uint8_t leadscrewPitch;             // Pitch of the leadscrew in TPI
   uint16_t leadScrewReductionFactor;   // Reduction factor of the leadscrew
+
+  float rapidSpeed;                   // Speed of moves that are not synchronized with the spindle, in steps per second
+  float rapidAcceleration;            // Acceleration of those moves, in steps per second squared
+
+  uint32_t interpolationMaxInterval;  // Longest time, in microseconds, over which an encoder sample is spread; 0 to disable
+
+  float maxStepRate;                  // Step rate assumed until the loop has measured its own, in steps per second
+  float stepRateWarning;              // Fraction of the maximum step rate above which a warning is shown
+
+  FeedbackT *feedback;                // Optional motor or carriage encoder; nullptr to run open loop
+  float feedbackCountsPerStep;        // Feedback counts per stepper step
+  bool feedbackOnMotor;               // The feedback encoder sees backlash take-up steps
+  float feedbackDeadband;             // Position errors up to this many steps are left alone
+  float feedbackMaxCorrection;        // Largest number of steps re-issued by a single correction
+  float feedbackCorrectionRate;       // Most steps re-issued per second, over any number of corrections
+  uint32_t feedbackLag;               // Microseconds the feedback may trail the step pulses by
+  float feedbackTolerance;            // Following errors beyond this many steps are a fault
+
+  EmergencyStop *emergencyStop;       // Optional emergency stop input; nullptr if none is wired
+
+  QuadratureEncoder *handwheel;       // Optional handwheel for jogging; nullptr if none is fitted
+  float handwheelCountsPerDetent;
+  float handwheelResolution;          // Inches moved per detent at the x1 multiplier
+  float handwheelFastRate;            // Detents per second above which each detent moves further, in proportion
+  float handwheelMaxScale;            // Most that a detent is scaled up by when the wheel is spun fast
+  float handwheelMaxLag;              // Inches the carriage may trail the wheel by; turns beyond that are dropped
+
+  float chipBreakRevolutions;         // Spindle revolutions fed between chip breaks
+  float chipBreakDwell;               // Spindle revolutions paused for at each break
+  float chipBreakRetract;             // Inches backed off at each break; 0 to only pause
+};
+
+
+enum LeadscrewFault : uint8_t {
+  NoFault = 0x00,
+  FollowingErrorFault = 0x01,
+  OverspeedFault = 0x02,
+  EncoderFault = 0x04,        // The spindle encoder gave no usable frames for too long
+  EmergencyStopFault = 0x08,  // Cleared only once the input has been released
+};
+
+
+enum ThreadingCycleState : uint8_t {
+  CycleOff,
+  CycleReady,                 // Armed, waiting for the first pass to be started
+  CycleCutting,               // Engaged and following the spindle
+  CycleReturning,             // Rapid move back to the start point
+  CycleWaitingForInfeed,      // Waiting for the operator to confirm the next pass
+  CycleWaitingForSync,        // Waiting for the spindle to reach the thread's phase
+};
+
+
+enum ChipBreakPhase : uint8_t {
+  ChipFeeding,
+  ChipPausing,                // Fed an interval; waiting out the dwell and any retract
+  ChipReturning,              // Moving back to where the retract started
+};
+
+
+/**
+ * @brief What a threading cycle needs to carry on after a reset
+ */
+struct LeadscrewCycle {
+  ThreadingCycleState state = CycleOff;
+  int8_t direction = 1;       // Direction of spindle rotation while cutting
+  uint8_t starts = 1;
+  uint8_t start = 0;
+  uint32_t passes = 0;
+  int64_t reference = 0;      // Encoder position at which the first pass was engaged
+  float startPosition = 0;    // Stepper position at the start of each pass
+  float length = 0;           // Length of each pass in steps
+  float ratio = 0;            // Spindle to leadscrew ratio the passes are cut at
 };
 
 
 struct LeadscrewState {
   bool engaged = false;
   float spindleToLeadScrewRatio = 1.0;
+  float feedRate = 0;         // Steps per second of a feed that ignores the spindle; 0 to follow it
+  float jogStepsPerCount = 0; // Steps per handwheel count while jogging; 0 when not jogging
+
+  int32_t chipBreakFeed = 0;  // Encoder counts fed between chip breaks; 0 when not breaking chips
+  int32_t chipBreakDwell = 0; // Encoder counts paused for at each break
+  float chipBreakRetract = 0; // Steps backed off at each break
+
+  bool cycle = false;
+  float cycleLength = 0;      // Length of each pass in steps
 };
 
 
+/**
+ * @brief Drives the leadscrew in step with the spindle.
+ *
+ * The spindle encoder, the stepper and the feedback encoder are
+ * template parameters rather than base classes, so the calls made
+ * by the loop are bound at compile time. The combinations in use
+ * are instantiated in Leadscrew.cpp and named in Machine.hpp.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
 class Leadscrew {
   public:
-    Leadscrew(LeadscrewSetup setup) : _setup(setup), _stepper(setup.stepper), _encoder(setup.encoder) {}
+    typedef LeadscrewSetup<EncoderT, StepperT, FeedbackT> Setup;
+
+    Leadscrew(Setup setup) : 
+      _setup(setup), _stepper(setup.stepper), _encoder(setup.encoder),
+      _ramp(setup.rapidSpeed, setup.rapidAcceleration), _maxStepRate(setup.maxStepRate)
+      {}
 
     void begin();
+
+    /**
+     * @brief Runs the loop forever. Specialized for each machine
+     *        in Leadscrew.cpp, which places it in RAM.
+     */
     void loop();
     
     void engage(bool engage);
@@ -33,12 +141,239 @@ class Leadscrew {
     void powerFeedIPR(float feedRate);
     float powerFeedIPR();
 
-    void threadTPI(uint8_t tpi);
+    void threadTPI(float tpi);
     float threadTPI();
 
     void threadMetric(float pitch);
     float threadMetric();
 
+    /**
+     * @brief Feed at a constant rate in inches per minute, without
+     *        following the spindle; negative rates feed the other
+     *        way. The feed is ramped up on engaging and down on
+     *        disengaging. Setting a pitch or a feed per revolution
+     *        goes back to following the spindle.
+     */
+    void feedPerMinute(float inchesPerMinute);
+    float feedPerMinute();
+
+    inline bool feeding() {
+      return _state.feedRate != 0;
+    }
+
+    /**
+     * @brief Move the carriage with the handwheel, through the same
+     *        acceleration limits as rapid moves. Only possible while
+     *        disengaged; engaging is refused until jogging ends.
+     */
+    void jog(bool enable);
+
+    inline bool jogging() {
+      bool result;
+
+      critical_section_enter_blocking(&_cs);
+      result = _guardedState.jogStepsPerCount != 0;
+      critical_section_exit(&_cs);
+
+      return result;
+    }
+
+    /**
+     * @brief Whether the carriage has been still for the given time
+     *        in milliseconds, with nothing about to move it: disengaged,
+     *        not jogging, the spindle stopped and any threading cycle
+     *        waiting on the operator. Writing to flash stalls the loop,
+     *        so it is only done at rest. Must be called from core 0.
+     */
+    bool atRest(uint32_t settleTime);
+
+    /**
+     * @brief Detents of the handwheel are worth this many times the
+     *        handwheel resolution, before any scaling for speed
+     */
+    void jogMultiplier(uint32_t multiplier);
+
+    inline uint32_t jogMultiplier() {
+      return _jogMultiplier;
+    }
+
+    /**
+     * @brief Interrupt a feed per revolution every so often to break
+     *        the chip. The feed is paused for a number of spindle
+     *        revolutions, optionally backing off first, and then carries
+     *        on. Both the interval and the pause are counted in spindle
+     *        encoder counts, so every break falls at the same point.
+     *        Pitches are never interrupted.
+     */
+    void chipBreaking(bool enable);
+
+    inline bool chipBreaking() {
+      return _chipBreaking;
+    }
+
+    /**
+     * @brief Set the interval between breaks in spindle revolutions,
+     *        or as a length fed at the current feed per revolution,
+     *        along with the pause and the retract at each break
+     */
+    void chipBreakRevolutions(float revolutions, float dwellRevolutions, float retractInches);
+    void chipBreakLength(float inches, float dwellRevolutions, float retractInches);
+
+    /**
+     * @brief The interval between breaks in spindle revolutions,
+     *        whichever way it was set
+     */
+    float chipBreakRevolutions();
+
+    inline uint32_t chipBreaks() {
+      return _chipBreaks;
+    }
+
+    /**
+     * @brief Multi-start threads are cut by shifting the phase
+     *        between the spindle and the leadscrew by a fraction
+     *        of a revolution for each start, instead of indexing
+     *        the chuck by hand.
+     */
+    void starts(uint8_t starts);
+    uint8_t starts();
+
+    void start(uint8_t start);
+    uint8_t start();
+
+    /**
+     * @brief Spindle angle, in degrees, by which the current start
+     *        is offset from the first one.
+     */
+    float startAngle();
+
+    /**
+     * @brief Semi-automatic threading cycle. Once armed, the start
+     *        point is taken from the current position; each pass is
+     *        engaged in phase with the spindle, disengaged after the
+     *        given length and followed by a rapid return to the start
+     *        point. While the cycle is active, engaging confirms the
+     *        next pass and disengaging aborts the cycle.
+     *
+     * @return false if the cycle could not be armed, as it cannot
+     *         be while jogging
+     */
+    bool cycle(bool enable);
+    bool cycle();
+
+    void cycleLength(float inches);
+    float cycleLength();
+
+    inline ThreadingCycleState cycleState() {
+      return _cycleState;
+    }
+
+    /**
+     * @brief The threading cycle as it stands, for carrying on with
+     *        it after a reset
+     */
+    LeadscrewCycle cycleCheckpoint();
+
+    /**
+     * @brief Carry on with a threading cycle saved before a reset.
+     *        The pitch must already be the one it was cut at. A pass
+     *        that was interrupted is not carried on with; the cycle
+     *        waits for the next one to be confirmed, and first brings
+     *        the carriage back to the start point if it is not there.
+     *
+     * @return false if the cycle could not be resumed
+     */
+    bool resumeCycle(const LeadscrewCycle &cycle);
+
+    inline uint32_t cyclePasses() {
+      return _cyclePasses;
+    }
+
+    inline uint8_t faults() {
+      return _faults;
+    }
+
+    void clearFaults();
+
+    /**
+     * @brief The difference in steps between the position the
+     *        gearing asks for and the position reported by the
+     *        feedback encoder. Always zero when running open loop.
+     */
+    inline float followingError() {
+      return _followingError;
+    }
+
+    inline float maxFollowingError() {
+      return _maxFollowingError;
+    }
+
+    inline uint32_t corrections() {
+      return _corrections;
+    }
+
+    /**
+     * @brief The highest step rate the loop can deliver. The
+     *        stepper issues at most one step every two iterations,
+     *        so this is half the iteration rate measured while the
+     *        leadscrew is moving.
+     */
+    inline float maxStepRate() {
+      return _maxStepRate;
+    }
+
+    /**
+     * @brief Scale the measured step rate by the change of the
+     *        system clock, until the loop measures it again
+     */
+    inline void scaleMaxStepRate(float factor) {
+      _maxStepRate = _maxStepRate * factor;
+    }
+
+    /**
+     * @brief The longest time, in microseconds, between two
+     *        consecutive iterations while the leadscrew was moving
+     */
+    inline uint32_t maxLoopLatency() {
+      return _maxLoopLatency;
+    }
+
+    inline void clearMaxLoopLatency() {
+      _maxLoopLatency = 0;
+    }
+
+    /**
+     * @brief The highest spindle speed at which the current
+     *        pitch or feed can be followed without losing steps.
+     *        Unlimited while feeding independently of the spindle.
+     */
+    float maxSafeRPM();
+
+    /**
+     * @brief Reports the current spindle speed. Engaging is refused
+     *        while it is above the maximum safe speed, and going above
+     *        it while engaged latches an overspeed fault.
+     */
+    void spindleSpeed(float rpm);
+
+    /**
+     * @brief Whether the spindle speed is close enough to the
+     *        maximum safe speed to warn the operator
+     */
+    bool stepRateWarning();
+
+    /**
+     * @brief The stepper driven by the loop, which is a copy
+     *        of the one given in the setup
+     */
+    inline StepperT &stepper() {
+      return _stepper;
+    }
+
+    inline Setup &setup() {
+      return _setup;
+    }
+
     inline uint32_t watchdog() {
       uint32_t result;
 
@@ -50,9 +385,9 @@ class Leadscrew {
     }
 
   protected:
-    LeadscrewSetup _setup;
-    Stepper _stepper;
-    Encoder &_encoder;
+    Setup _setup;
+    StepperT _stepper;
+    EncoderT &_encoder;
     critical_section_t _cs;
 
     /**
@@ -67,7 +402,9 @@ class Leadscrew {
     /**
      * @brief This variable holds a copy of the leadscrew's
      *       state that can be accessed without a critical
-     *       section.
+     *       section. Whether it is engaged, cycling or jogging
+     *       is not kept in it, since the loop changes those on
+     *       its own; they are read from the guarded state.
      * 
      */
     LeadscrewState _state;
@@ -78,5 +415,110 @@ class Leadscrew {
      * 
      */
     LeadscrewState _guardedState;
+
+    /**
+     * @brief Used for all moves that are not synchronized with
+     *        the spindle. Only touched by the loop.
+     */
+    Ramp _ramp;
+
+    // Step interpolation state, only touched by the loop
+
+    float _residual = 0;                  // Fraction of a step not yet added to the desired position
+    float _interpolationRemaining = 0;    // Steps from encoder samples not yet fed in
+    float _interpolationRate = 0;         // Steps per microsecond
+    uint32_t _interpolationTime = 0;
+    uint32_t _lastSampleTime = 0;
+    bool _wasEngaged = false;
+    bool _wasActive = false;
+
+    volatile uint32_t _activeIterations = 0;  // Counted by the loop while anything is moving
+    uint32_t _restIterations = 0;             // Count last seen by atRest()
+    absolute_time_t _restTime = 0;            // Time atRest() first found the carriage still
+
+    volatile ThreadingCycleState _cycleState = CycleOff;
+    volatile uint32_t _cyclePasses = 0;
+    bool _cycleConfirmed = false;         // Guarded; consumed by the loop
+    bool _cycleResumed = false;           // Guarded; consumed by the loop along with the cycle below
+    LeadscrewCycle _resumedCycle;         // Guarded
+    LeadscrewCycle _guardedCycle;         // Guarded; published by the loop whenever the cycle state changes
+    float _cycleStart = 0;                // Stepper position at the start of each pass
+    int64_t _cycleReference = 0;          // Encoder position at which the first pass was engaged
+    int32_t _cycleDirection = 1;          // Direction of spindle rotation while cutting
+    int32_t _cycleLastOffset = 0;
+
+    uint8_t _starts = 1;
+    uint8_t _start = 0;
+    float _phase = 0;                     // Phase of the current start in encoder counts
+    float _pendingPhaseShift = 0;         // Guarded; consumed by the loop while engaged
+
+    // Handwheel state, only touched by the loop except for
+    // the multiplier which is set from the other core
+
+    uint32_t _jogMultiplier = 1;
+    float _jogMaxLag = 0;                 // In steps
+    int32_t _jogCount = 0;
+    uint32_t _jogTime = 0;
+    float _jogRate = 0;                   // Detents per second, smoothed
+    bool _wasJogging = false;
+
+    // Chip breaking state. The settings are only touched from the
+    // other core; the phase is only touched by the loop
+
+    bool _chipBreaking = false;
+    bool _threading = false;
+    float _chipBreakLength = 0;           // In inches; 0 when the interval is in revolutions
+    ChipBreakPhase _chipPhase = ChipFeeding;
+    int32_t _chipRemaining = 0;           // Encoder counts left in the current phase
+    float _chipRetracted = 0;             // Steps backed off by the current break
+    bool _wasBreakingChips = false;
+    volatile uint32_t _chipBreaks = 0;
+
+    volatile uint8_t _faults = NoFault;
+    LeadscrewFault _pendingFault = NoFault;   // Guarded; raised by the loop on behalf of the other core
+
+    // Step rate budget. The measurement is only touched by the
+    // loop; the spindle speed is written from the other core
+
+    volatile float _maxStepRate;
+    uint32_t _stepRateWindowStart = 0;
+    uint32_t _stepRateIterations = 0;
+    uint32_t _lastIterationTime = 0;
+    volatile uint32_t _maxLoopLatency = 0;
+    volatile float _spindleSpeed = 0;
+
+    // Closed loop state, only touched by the loop except for
+    // the statistics which are read from the other core
+
+    int32_t _feedbackOriginCount = 0;
+    float _feedbackOriginPosition = 0;
+    int32_t _feedbackOriginBacklash = 0;
+    float _feedbackHistory[LEADSCREW_FEEDBACK_HISTORY];  // Stepper positions over the last feedback lag
+    uint8_t _feedbackHistoryIndex = 0;
+    uint32_t _feedbackHistoryTime = 0;
+    uint32_t _correctionTime = 0;
+    float _correctionBudget = 0;          // Steps that may be re-issued right now
+    volatile float _followingError = 0;
+    volatile float _maxFollowingError = 0;
+    volatile uint32_t _corrections = 0;
+
+    void _iterate();
+    float _interpolate(int32_t positionDifference, float ratio, uint32_t now);
+    void _engaged(bool engaged);
+    void _spindleToLeadScrewRatio(float ratio, bool threading);
+    void _updateSampling(bool engaging = false);
+    void _updateChipBreaking();
+    int32_t _chipBreak(int32_t positionDifference, const LeadscrewState &state);
+    void _cycle(LeadscrewState &state, bool confirmed);
+    void _resumeCycle(const LeadscrewCycle &cycle);
+    int32_t _cycleOffset(int64_t position);
+    float _stepsPerInch();
+
+    void _fault(LeadscrewFault fault);
+    void _emergencyStop();
+    void _jog(float stepsPerCount);
+    void _measureStepRate(uint32_t now);
+    void _feedbackOrigin(uint32_t now);
+    void _updateFollowingError(uint32_t now);
 };
 
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Config.hpp>
+
+#include <encoder.hpp>
+#include <Stepper.hpp>
+#include <QuadratureEncoder.hpp>
+#include <Leadscrew.hpp>
+
+
+/**
+ * @brief The spindle and feedback encoders of the lathe itself.
+ */
+struct HardwareMachine {
+  typedef Encoder SpindleEncoder;
+  typedef QuadratureEncoder FeedbackEncoder;
+
+  static constexpr bool simulated = false;
+};
+
+
+/**
+ * @brief Simulated encoders, for running without a lathe. The
+ *        feedback encoder counts the stepper's own pulses.
+ */
+struct SimulatedMachine {
+  typedef EncoderSimulator SpindleEncoder;
+  typedef QuadratureEncoderSimulator FeedbackEncoder;
+
+  static constexpr bool simulated = true;
+};
+
+
+template <typename MachineT>
+using MachineLeadscrewFor = Leadscrew<typename MachineT::SpindleEncoder, Stepper, typename MachineT::FeedbackEncoder>;
+
+
+// The machine the firmware is built for. This is the only place
+// where SIMULATE_ENCODER is looked at; everything else follows
+// from the types chosen here.
+
+#ifdef SIMULATE_ENCODER
+typedef SimulatedMachine Machine;
+#else // SIMULATE_ENCODER
+typedef HardwareMachine Machine;
+#endif // SIMULATE_ENCODER
+
+typedef MachineLeadscrewFor<Machine> MachineLeadscrew;
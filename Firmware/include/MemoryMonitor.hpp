@@ -0,0 +1,94 @@
+#pragma once
+
+#include <Arduino.h>
+
+
+#define MEMORY_MONITOR_PAINT 0xDEADBEEF   // Pattern left in stack words that were never used
+
+
+struct _reent;
+extern "C" void *__wrap__malloc_r(struct _reent *reent, size_t size);
+
+
+/**
+ * @brief Reports heap use and the deepest stack use of each core.
+ *
+ * Each core paints the free part of its stack when it starts, so
+ * that the deepest point reached can be found later on. In builds
+ * with ZERO_HEAP defined the allocator is wrapped, and allocating
+ * once both cores have called ready() panics; with
+ * ZERO_HEAP_DIAGNOSTIC also defined it is only counted instead.
+ */
+class MemoryMonitor {
+  friend class AllocationPermit;
+  friend void *__wrap__malloc_r(struct _reent *reent, size_t size);
+public:
+  void paintStack();
+
+  /**
+   * @brief Called by each core once it has finished its setup.
+   *        Allocations are guarded from then on.
+   */
+  void ready();
+
+  inline bool armed() {
+    return _ready[0] && _ready[1];
+  }
+
+  uint32_t stackSize(uint core);
+  uint32_t stackUsed(uint core);
+
+  uint32_t heapPeak();
+  uint32_t heapUsed();
+
+  inline uint32_t allocations(uint core) {
+    return _allocations[core];
+  }
+
+  inline uint32_t largestAllocation() {
+    return _largestAllocation;
+  }
+
+  /**
+   * @brief Cached flash accesses, by either core, since the XIP
+   *        counters were last cleared. Every access that is not a
+   *        hit stalls the core that made it on a QSPI read.
+   */
+  uint32_t xipAccesses();
+  uint32_t xipHits();
+  void clearXipCounters();
+
+protected:
+  volatile bool _ready[2] = { false, false };
+  volatile uint32_t _permits[2] = { 0, 0 };
+  volatile uint32_t _allocations[2] = { 0, 0 };
+  volatile uint32_t _largestAllocation = 0;
+
+  void _allocation(size_t size);
+};
+
+
+extern MemoryMonitor memoryMonitor;
+
+
+/**
+ * @brief Allows the current core to allocate for as long as it
+ *        exists. Only meant for slow paths that can't avoid the
+ *        heap, such as opening files on the flash filesystem.
+ */
+class AllocationPermit {
+public:
+#ifdef ZERO_HEAP
+  AllocationPermit() {
+    const uint core = get_core_num();
+    memoryMonitor._permits[core] = memoryMonitor._permits[core] + 1;
+  }
+
+  ~AllocationPermit() {
+    const uint core = get_core_num();
+    memoryMonitor._permits[core] = memoryMonitor._permits[core] - 1;
+  }
+#else // ZERO_HEAP
+  AllocationPermit() {}
+#endif // ZERO_HEAP
+};
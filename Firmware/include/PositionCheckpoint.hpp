@@ -0,0 +1,139 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <Machine.hpp>
+#include <Display.hpp>
+
+
+#define POSITION_CHECKPOINT_MAGIC 0x43504B32    // "CPK2"
+#define POSITION_CHECKPOINT_WORDS 12            // Words in a saved record, the check word included
+
+
+typedef struct {
+  MachineLeadscrew &leadscrew;
+  Encoder &encoder;
+  Display &display;
+
+  const char *path;                 // LittleFS file holding the positions across power cycles
+  uint32_t interval;                // Milliseconds between updates of the copy kept in RAM
+  uint32_t saveDelay;               // Milliseconds the machine must be at rest before the positions are saved to flash
+} PositionCheckpointSetup;
+
+
+struct PositionCheckpointRecord {
+  int64_t spindlePosition;          // Cumulative spindle encoder position
+  float carriagePosition;           // Stepper position, in steps
+  LeadscrewCycle cycle;             // Threading cycle in progress; its state is CycleOff when there is none
+  uint8_t mode;                     // Display mode the cycle's pitch was set in
+  float pitch;                      // The cycle's pitch, in that mode's units
+};
+
+
+typedef enum : uint8_t {
+  CheckpointNone,
+  CheckpointScratch,                // Kept in RAM through a reset or a watchdog reboot
+  CheckpointFlash,                  // Saved the last time the machine was at rest
+} PositionCheckpointSource;
+
+
+/**
+ * @brief Keeps the spindle and carriage positions across resets and
+ *        power cycles, so that a reference taken against them is
+ *        still good after booting.
+ *
+ * The positions are written every few milliseconds to RAM that the
+ * runtime leaves uninitialised, which survives anything short of a
+ * power cut, and to flash once the machine has come to rest, which
+ * does not stall the leadscrew while it matters. On booting the RAM
+ * copy is used if it is intact, and the flash copy otherwise.
+ *
+ * The spindle position is picked up from the encoder's absolute
+ * reading, so it is right however far the spindle turned while the
+ * power was off, within the encoder's multi-turn range. The carriage
+ * is open loop and is assumed to have stayed where it was saved.
+ *
+ * A threading cycle is saved along with them, so that its spindle
+ * reference still holds and the thread can be picked up again
+ * without being synchronised by hand.
+ */
+class PositionCheckpoint {
+public:
+  PositionCheckpoint(PositionCheckpointSetup setup) : _setup(setup) {}
+
+  /**
+   * @brief Reads back the saved positions. Must be called on the
+   *        core that owns the filesystem, after it is mounted.
+   */
+  void begin();
+
+  /**
+   * @brief Waits for begin() on the other core, then hands the saved
+   *        positions to the encoder and the leadscrew's stepper. Must
+   *        be called before the leadscrew loop starts.
+   */
+  template <typename EncoderT>
+  void resume(EncoderT &encoder) {
+    while (!_loaded) {
+      tight_loop_contents();
+    }
+
+    if (_source != CheckpointNone) {
+      Stepper &stepper = _setup.leadscrew.stepper();
+
+      encoder.resume(_record.spindlePosition);
+      stepper.position = _record.carriagePosition;
+      stepper.desiredPosition = _record.carriagePosition;
+    }
+
+    _resumed = true;
+  }
+
+  /**
+   * @brief Puts the display back on the saved cycle's pitch and
+   *        carries on with the cycle. Must be called after the
+   *        display has started, which would otherwise reset it.
+   */
+  void resumeCycle();
+
+  /**
+   * @brief Keeps the checkpoints up to date. Must be called from
+   *        the main loop.
+   */
+  void loop();
+
+  inline PositionCheckpointSource source() {
+    return _source;
+  }
+
+  inline bool cycleResumed() {
+    return _cycleResumed;
+  }
+
+  inline uint32_t saves() {
+    return _saves;
+  }
+
+protected:
+  PositionCheckpointSetup _setup;
+
+  PositionCheckpointRecord _record;
+  volatile PositionCheckpointSource _source = CheckpointNone;
+  volatile bool _loaded = false;
+  volatile bool _resumed = false;
+
+  absolute_time_t _nextUpdate = 0;
+  absolute_time_t _restTime = 0;    // Time the record last changed
+  uint32_t _last[POSITION_CHECKPOINT_WORDS] = {};
+  uint32_t _saved[POSITION_CHECKPOINT_WORDS] = {};
+  uint32_t _saves = 0;
+  bool _cycleResumed = false;
+
+  PositionCheckpointRecord _current();
+  void _encode(const PositionCheckpointRecord &record, uint32_t *words);
+  bool _decode(const uint32_t *words, PositionCheckpointRecord &record);
+  void _writeScratch(const uint32_t *words);
+  bool _readFile(uint32_t *words);
+  bool _writeFile(const uint32_t *words);
+  uint32_t _check(const uint32_t *words);
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <Arduino.h>
+#include "hardware/pio.h"
+
+
+#define QUADRATURE_ENCODER_SIMULATOR_HISTORY 16   // Counts kept to delay the simulated count by its lag
+
+
+typedef struct {
+  PIO pio;
+  pin_size_t pinA;              // Phase A; phase B must be on the next pin
+  uint32_t maxStepRate;         // Highest expected count rate; 0 samples at full speed
+} QuadratureEncoderSetup;
+
+
+/**
+ * @brief An incremental quadrature encoder counted in hardware
+ *        by a PIO state machine, so that no edge is ever missed
+ *        regardless of what the CPU is doing.
+ */
+class QuadratureEncoder {
+public:
+  QuadratureEncoder(QuadratureEncoderSetup setup) : _setup(setup) {}
+
+  void begin();
+  int32_t count();
+
+  /**
+   * @brief Follow a change of the system clock
+   */
+  void retime();
+
+protected:
+  QuadratureEncoderSetup _setup;
+  uint _sm;
+  uint32_t _count = 0;          // Last count read from the FIFO
+};
+
+
+typedef struct {
+  pin_size_t pulsePin;          // Stepper pulse pin to monitor
+  pin_size_t directionPin;      // Stepper direction pin to monitor
+  float countsPerStep;          // Counts produced for every step pulse
+  uint32_t maxStepRate;         // Pulses arriving faster than this are lost; 0 to disable
+  uint32_t backlash;            // Steps of lost motion between the motor and the carriage
+  uint32_t lag;                 // Microseconds the count trails the pulses by, as a real encoder's does; 0 for none
+} QuadratureEncoderSimulatorSetup;
+
+
+/**
+ * @brief Simulates a motor-side encoder by counting the pulses
+ *        emitted on the stepper's own output pins.
+ *
+ * Missed steps can be injected on demand with missSteps(), and
+ * pulses that arrive faster than the configured maximum step rate
+ * are dropped, mimicking a motor that stalls at high speed. With
+ * backlash set, the count follows a carriage driven through that
+ * much lost motion rather than the motor itself. With lag set, the
+ * count is the one from that long ago, sampled as it is read.
+ *
+ * Like EncoderSimulator, it hides rather than overrides the
+ * encoder's methods and must be used through its own type.
+ */
+class QuadratureEncoderSimulator : public QuadratureEncoder {
+  friend void _quadratureEncoderSimulatorIRQ();
+public:
+  QuadratureEncoderSimulator(QuadratureEncoderSimulatorSetup simulation) : QuadratureEncoder({}), _simulation(simulation) {}
+
+  void begin();
+  int32_t count();
+  void retime() {}
+
+  void missSteps(uint32_t steps);
+
+  inline QuadratureEncoderSimulatorSetup &simulation() {
+    return _simulation;
+  }
+
+protected:
+  QuadratureEncoderSimulatorSetup _simulation;
+
+  volatile int32_t _steps = 0;     // Carriage position
+  int32_t _motor = 0;               // Motor position
+  volatile uint32_t _missRemaining = 0;
+  uint32_t _lastPulseTime = 0;
+  uint32_t _minPulseInterval = 0;
+
+  int32_t _history[QUADRATURE_ENCODER_SIMULATOR_HISTORY] = {};
+  uint8_t _historyIndex = 0;
+  uint32_t _historyTime = 0;
+
+  void _pulse();
+};
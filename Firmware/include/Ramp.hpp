@@ -0,0 +1,153 @@
+#pragma once
+
+#include <Arduino.h>
+#include <algorithm>
+
+
+/**
+ * @brief Generates a trapezoidal motion profile towards a target
+ *        position, limited in speed and acceleration.
+ *
+ * Positions are in stepper steps, speeds in steps per second and
+ * accelerations in steps per second squared. advance() is meant to
+ * be called on every iteration of the leadscrew loop and returns
+ * how far the profile moved since the previous call, so that the
+ * result can be added directly to the stepper's desired position.
+ *
+ * Instead of a target, the ramp can also be given a speed to run
+ * at, which it reaches and leaves at the same acceleration.
+ */
+class Ramp {
+public:
+  Ramp(float maxSpeed, float acceleration) : _maxSpeed(maxSpeed), _acceleration(acceleration) {}
+
+  inline void moveBy(float distance) {
+    if (_idle) {
+      _lastUpdate = time_us_32();
+    }
+
+    _target += distance;
+    _idle = false;
+  }
+
+  /**
+   * @brief Run at the given speed until told otherwise. A speed
+   *        of zero decelerates to a stop, after which the ramp
+   *        is idle again.
+   */
+  inline void run(float speed) {
+    if (_idle) {
+      _lastUpdate = time_us_32();
+    }
+
+    _runSpeed = std::clamp(speed, -_maxSpeed, _maxSpeed);
+    _running = true;
+    _idle = false;
+  }
+
+  inline bool running() {
+    return _running;
+  }
+
+  inline bool idle() {
+    return _idle;
+  }
+
+  inline float remaining() {
+    return _target - _position;
+  }
+
+  inline float speed() {
+    return _speed;
+  }
+
+  /**
+   * @brief Drop any motion that is still pending.
+   */
+  inline void reset() {
+    _target = _position;
+    _speed = 0;
+    _running = false;
+    _idle = true;
+  }
+
+  float __not_in_flash_func(advance)(uint32_t now) {
+    // Signed, since the ramp may have been started after
+    // the time passed in was read
+
+    const float dt = float(int32_t(now - _lastUpdate)) / 1000000.0f;
+
+    _lastUpdate = now;
+
+    if (_idle || dt <= 0) {
+      return 0;
+    }
+
+    if (_running) {
+      const float change = _acceleration * dt;
+
+      _speed = _speed < _runSpeed ? std::min(_speed + change, _runSpeed) : std::max(_speed - change, _runSpeed);
+
+      // Moves asked for while running are dropped along
+      // with it, so they don't jump in once it has stopped
+
+      if (_speed == 0 && _runSpeed == 0) {
+        _position = 0;
+        _target = 0;
+        _running = false;
+        _idle = true;
+      }
+
+      return _speed * dt;
+    }
+
+    const float remaining = _target - _position;
+    const float direction = remaining >= 0 ? 1.0f : -1.0f;
+    const float stoppingDistance = _speed * _speed / (2 * _acceleration);
+
+    // Decelerate when moving away from the target or when the
+    // remaining distance is only just enough to stop in time
+
+    if (_speed * direction < 0 || fabsf(remaining) <= stoppingDistance) {
+      _speed -= (_speed > 0 ? 1.0f : -1.0f) * _acceleration * dt;
+    } else {
+      _speed += direction * _acceleration * dt;
+    }
+
+    _speed = std::clamp(_speed, -_maxSpeed, _maxSpeed);
+
+    const float previous = _position;
+
+    _position += _speed * dt;
+
+    // Snap to the target once it has been reached or overshot
+    // at a speed that could be stopped within a single update.
+    // Both are then rebased to zero to keep float precision.
+
+    if ((_target - _position) * direction <= 0 || (fabsf(_target - _position) < 0.5f && fabsf(_speed) <= _acceleration * dt)) {
+      const float moved = _target - previous;
+
+      _position = 0;
+      _target = 0;
+      _speed = 0;
+      _idle = true;
+
+      return moved;
+    }
+
+    return _position - previous;
+  }
+
+protected:
+  float _maxSpeed;
+  float _acceleration;
+
+  float _position = 0;
+  float _target = 0;
+  float _speed = 0;
+  float _runSpeed = 0;
+  bool _running = false;
+  bool _idle = true;
+
+  uint32_t _lastUpdate = 0;
+};
@@ -4,38 +4,107 @@
 
 #include <Config.hpp>
 
-#include <Encoder.hpp>
-#include <Leadscrew.hpp>
+#include <Machine.hpp>
 #include <Display.hpp>
 #include <Tachometer.hpp>
+#include <FlightRecorder.hpp>
+#include <MemoryMonitor.hpp>
+#include <EmergencyStop.hpp>
+#include <PositionCheckpoint.hpp>
+#include <ClockProfiles.hpp>
+
+
+#define SERIAL_DEBUG_LINE_LENGTH 64      // Longest command line accepted
+#define SERIAL_DEBUG_PRINT_LENGTH 96     // Longest line printed in one go
+#define SERIAL_DEBUG_MAX_ARGUMENTS 3
+#define SERIAL_DEBUG_MAX_PARAMETERS 24
 
 
 typedef struct {
-#ifdef SIMULATE_ENCODER
-  EncoderSimulator &encoder;
-#else // SIMULATE_ENCODER
-  Encoder &encoder;
-#endif // SIMULATE_ENCODER
-  Leadscrew &leadscrew;
+  Machine::SpindleEncoder &encoder;
+  MachineLeadscrew &leadscrew;
   Display &display;
   Tachometer &tachometer;
+  FlightRecorder &flightRecorder;
+  MemoryMonitor &memoryMonitor;
+  Machine::FeedbackEncoder &feedback;
+  EmergencyStop &emergencyStop;
+  PositionCheckpoint &checkpoint;
+  ClockProfiles &clockProfiles;
 
   uint32_t updateInterval;
+  uint32_t calibrationRevolutions;  // Revolutions the encoder learns from when calibrate is given no number
+  uint32_t saveDelay;               // Milliseconds the carriage must be at rest before a calibration is saved to flash
 } SerialDebugSetup;
 
 
+typedef enum {
+  ParameterUInt32,
+  ParameterFloat,
+  ParameterBool,
+} SerialDebugParameterType;
+
+
+/**
+ * @brief A setup field that can be changed at runtime, named
+ *        after the Config entry it was initialised from.
+ */
+typedef struct {
+  const char *name;
+  SerialDebugParameterType type;
+  void *value;
+  float min;
+  float max;
+} SerialDebugParameter;
+
+
+/**
+ * @brief A line-oriented command interface on the serial port.
+ *
+ * Everything runs from loop(), outside of interrupt context. Input
+ * is drained from the USB serial receive buffer without blocking and
+ * executed one line at a time; type "help" for a list of commands.
+ */
 class SerialDebug {
-  friend bool _serialDebugTimerCallback(repeating_timer_t *rt);
 public:
   SerialDebug(SerialDebugSetup setup) : _setup(setup) {}
 
   void begin();
 
+  /**
+   * @brief Reads and executes commands and prints the status
+   *        when watching. Must be called from the main loop.
+   */
+  void loop();
+
 protected:
   SerialDebugSetup _setup;
-  repeating_timer_t _timer;
-  critical_section_t _cs;
 
-  void _loop();
-};
+  char _line[SERIAL_DEBUG_LINE_LENGTH];
+  size_t _lineLength = 0;
+  bool _lineOverflow = false;
+
+  bool _watching = false;
+  absolute_time_t _nextStatus = 0;
+
+  bool _calibrating = false;
 
+  SerialDebugParameter _parameters[SERIAL_DEBUG_MAX_PARAMETERS];
+  size_t _parameterCount = 0;
+
+  void _execute(char *line);
+  void _status();
+  void _counters();
+  void _memory();
+  void _calibrate(const char *argument);
+  void _finishCalibration();
+  void _clock(const char *argument);
+  void _help();
+  void _printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  void _get(const char *name);
+  void _set(const char *name, const char *value);
+  bool _consistent(const void *field, float value);
+  void _printParameter(const SerialDebugParameter &parameter);
+  SerialDebugParameter *_parameter(const char *name);
+};
@@ -6,6 +6,7 @@ struct StepperSetup {
   uint8_t directionPin;
   uint8_t pulsePin;
   float stepsPerRevolution;
+  uint32_t backlash;          // Steps of lost motion taken up on every reversal
 };
 
 class Stepper {
@@ -25,10 +26,60 @@ public:
     return _setup.stepsPerRevolution;
   }
 
+  inline StepperSetup &setup() {
+    return _setup;
+  }
+
+  /**
+   * @brief Net number of take-up steps issued, i.e. how far the
+   *        motor is ahead of position because of backlash
+   */
+  inline int32_t backlashOffset() {
+    return _backlashOffset;
+  }
+
+  inline uint32_t takeUpSteps() {
+    return _takeUpSteps;
+  }
+
+  inline uint32_t reversals() {
+    return _reversals;
+  }
+
+  /**
+   * @brief Pulses issued since starting, including take-up steps
+   */
+  inline uint32_t steps() {
+    return _steps;
+  }
+
+  /**
+   * @brief Record the steps issued since the last entry in the
+   *        flight recorder. The loop records them once per summary
+   *        interval on its own; this is for when it stops stepping.
+   */
+  void recordSteps();
+
 protected:
   StepperSetup _setup;
 
   bool _enabled = false;
   bool _stepping = false;
+  volatile uint32_t _steps = 0;
+
+  // Steps not yet recorded in the flight recorder
+
+  int32_t _unrecordedSteps = 0;
+  int32_t _unrecordedTakeUp = 0;
+  uint32_t _recordTime = 0;
+
+  // Backlash compensation. Take-up steps move the motor but not
+  // position, so that the synchronized position stays exact.
+
+  int32_t _direction = 0;
+  uint32_t _takeUp = 0;
+  volatile int32_t _backlashOffset = 0;
+  volatile uint32_t _takeUpSteps = 0;
+  volatile uint32_t _reversals = 0;
 };
 
@@ -1,7 +1,7 @@
 #pragma once
 
 #include <Arduino.h>
-#include <Encoder.hpp>
+#include <encoder.hpp>
 
 
 class Tachometer {
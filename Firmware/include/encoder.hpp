@@ -4,13 +4,36 @@
 #include <SPI.h>
 
 
+#define ENCODER_MAX_FRAME_BITS 32             // Longest frame, status bits included, that can be read
+#define ENCODER_PLAUSIBILITY_SLACK 2          // Counts allowed on top of the fastest possible motion, for jitter
+#define ENCODER_PLAUSIBILITY_MAX_TIME 100000  // Microseconds beyond which any change of position is plausible
+#define ENCODER_CORRECTION_BITS 8             // The correction table has this many bits of angle
+#define ENCODER_CORRECTION_BINS (1 << ENCODER_CORRECTION_BITS)
+#define ENCODER_CORRECTION_MAGIC 0x45435431   // "ECT1"
+
+
 typedef struct {
   pin_size_t miso;
   pin_size_t clk;
   uint32_t clockSpeed;
   uint8_t resolutionBits;
   float stepsPerRevolution;
-  uint32_t updateInterval;
+  uint32_t updateInterval;          // Poll interval in microseconds while the spindle is moving
+  uint32_t idleUpdateInterval;      // Longest poll interval, used while the spindle is stopped
+  uint32_t slowDownDelay;           // Time in milliseconds the poll interval is held before it is lengthened
+  uint32_t countsPerSample;         // Counts per sample aimed for while disengaged
+
+  uint8_t frameBits;                // Gray coded position bits in each frame, multi-turn bits included
+  bool multiTurn;                   // The frame bits above the resolution count whole turns, and are decoded too
+  uint8_t statusBits;               // Status bits following the position, parity included
+  uint32_t statusErrorMask;         // Status bits that flag an error when set
+  bool parity;                      // The last status bit makes the parity of the whole frame even
+  float maxSpeed;                   // Fastest the spindle can turn, in RPM; samples implying more are rejected. 0 to disable
+  uint32_t maxRetries;              // Frames read again after a bad one before the previous position is held
+  uint32_t retryDelay;              // Microseconds to wait before reading again, for the encoder to latch a new frame
+  uint32_t maxHeldSamples;          // Consecutive held samples after which the encoder is considered lost
+
+  const char *correctionPath;       // LittleFS file holding the learned correction table
 } EncoderSetup;
 
 
@@ -19,7 +42,7 @@ class Encoder {
 public:
   Encoder(EncoderSetup setup) : _setup(setup) {}
 
-  virtual void begin();
+  void begin();
 
   inline int32_t positionDifference() {
     int32_t result;
@@ -32,10 +55,74 @@ public:
     return result;
   }
 
+  /**
+   * @brief Clears the position difference and returns the
+   *        cumulative position at that same instant.
+   */
+  inline int64_t clearPositionDifference() {
+    int64_t result;
+
+    critical_section_enter_blocking(&_cs);
+    _positionDifference = 0;
+    result = _cumulativePosition;
+    critical_section_exit(&_cs);
+
+    return result;
+  }
+
+  /**
+   * @brief The setup in use. Fields that are read on every
+   *        update can be tuned while running.
+   */
+  inline EncoderSetup &setup() {
+    return _setup;
+  }
+
+  /**
+   * @brief Counts per revolution, used for every angle and speed
+   *        worked out from the position. begin() checks that it
+   *        matches the resolution the frames are decoded at.
+   */
   inline float stepsPerRevolution() {
     return _setup.stepsPerRevolution;
   }
 
+  /**
+   * @brief The current poll interval in microseconds. It adapts to
+   *        the spindle speed unless fast sampling is requested.
+   */
+  inline uint32_t updateInterval() {
+    return _interval;
+  }
+
+  /**
+   * @brief Request polling at the full rate, regardless of speed.
+   *        Used while the leadscrew is following the spindle.
+   */
+  inline void fastSampling(bool fast) {
+    _fastSampling = fast;
+  }
+
+  /**
+   * @brief Carry on from a cumulative position saved before a
+   *        reset, going the shortest way round to the current
+   *        reading. Without multi-turn bits that is only right if
+   *        the spindle turned by less than half a revolution since.
+   */
+  void resume(int64_t position);
+
+  /**
+   * @brief Set the SPI clock again after the peripheral clock
+   *        has changed
+   */
+  void retime();
+
+  /**
+   * @brief Stop sampling while the clocks are changed, and start
+   *        again at the same interval once they have settled
+   */
+  void pause(bool pause);
+
   inline int64_t cumulativePosition() {
     int64_t result;
 
@@ -46,12 +133,105 @@ public:
     return result;
   }
 
+  inline uint32_t deadlineMisses() {
+    return _deadlineMisses;
+  }
+
+  /**
+   * @brief Number of samples taken since starting
+   */
+  inline uint32_t samples() {
+    return _samples;
+  }
+
+  /**
+   * @brief Frames rejected for their parity, their status bits or
+   *        the level of the data line after them
+   */
+  inline uint32_t frameErrors() {
+    return _frameErrors;
+  }
+
+  /**
+   * @brief Frames rejected because the spindle could not have
+   *        turned that far since the last good one
+   */
+  inline uint32_t implausibleFrames() {
+    return _implausibleFrames;
+  }
+
+  /**
+   * @brief Samples for which every retry failed, and the previous
+   *        position was held instead
+   */
+  inline uint32_t heldSamples() {
+    return _heldSamples;
+  }
+
+  /**
+   * @brief Whether the position has been held for too many samples
+   *        in a row to be trusted
+   */
+  inline bool lost() {
+    return _setup.maxHeldSamples && _consecutiveHolds >= _setup.maxHeldSamples;
+  }
+
+  /**
+   * @brief Learn the encoder's error over the given number of
+   *        revolutions, which the spindle must turn at a constant
+   *        speed. Each position is compared with where a steady
+   *        spindle would be, timed from the last whole revolution.
+   *        0 stops learning.
+   */
+  void calibrate(uint32_t revolutions);
+
+  inline bool calibrating() {
+    return _calibrationRevolutions != 0;
+  }
+
+  /**
+   * @brief Once calibrate() has run its course, turn what was learned
+   *        into the correction table and start using it. The position
+   *        carries on from where it was, but the motion after it is
+   *        corrected differently, so this must only be done while the
+   *        leadscrew is disengaged.
+   *
+   * @return false if nothing was learned, or some angle was never seen
+   */
+  bool finishCalibration();
+
+  /**
+   * @brief Read the correction table saved by the last calibration.
+   *        Must be called once on booting, found or not, since the
+   *        other core waits for it in awaitCorrection().
+   */
+  bool loadCorrection();
+
+  /**
+   * @brief Wait for loadCorrection() on the other core, so that the
+   *        position starts out in the corrected angles it was saved in
+   */
+  void awaitCorrection();
+  bool saveCorrection();
+  void clearCorrection();
+
+  /**
+   * @brief Largest correction in the table, in counts
+   */
+  int32_t correctionPeak();
+
 protected:
   critical_section_t _cs;
   repeating_timer_t _timer;
-  uint8_t _buf[3];
+  uint8_t _buf[ENCODER_MAX_FRAME_BITS / 8];
   EncoderSetup _setup;
 
+  uint8_t _frameBytes;
+  uint8_t _positionBits;                // Bits of the frame kept as the position, multi-turn bits included
+  uint32_t _maxCountsPerMicrosecond;    // Fixed point, 8 fractional bits
+  bool _positionValid = false;
+  absolute_time_t _validReadTime;       // Time of the last frame that was accepted
+
   uint32_t _position;
   int32_t _positionDifference;
   absolute_time_t _positionReadTime;
@@ -60,9 +240,94 @@ protected:
 
   int64_t _cumulativePosition;
 
+  // Correction of the single-turn error, subtracted from each
+  // position according to its angle
+
+  int16_t _correction[ENCODER_CORRECTION_BINS] = {};
+  uint8_t _correctionShift;
+  int32_t _lastCorrection = 0;
+  bool _correctionChanged = false;    // Guarded; set when the table is replaced
+  volatile bool _correctionLoaded = false;
+
+  // Calibration state, only touched by the loop while learning
+
+  volatile uint32_t _calibrationRevolutions = 0;
+  bool _calibrationLearned = false;
+  bool _revolutionTimed = false;
+  int64_t _calibrationPosition;         // Uncorrected position since learning started
+  int64_t _revolutionStart;
+  absolute_time_t _revolutionStartTime;
+  float _countsPerMicrosecond;          // Over the last whole revolution; 0 until one has been timed
+  float _calibrationSum[ENCODER_CORRECTION_BINS];
+  uint32_t _calibrationCount[ENCODER_CORRECTION_BINS];
+
+  uint32_t _deadlineMisses = 0;
+  volatile uint32_t _samples = 0;
+
+  volatile uint32_t _frameErrors = 0;
+  volatile uint32_t _implausibleFrames = 0;
+  volatile uint32_t _heldSamples = 0;
+  volatile uint32_t _consecutiveHolds = 0;
+
+  int32_t _unrecordedDiff = 0;         // Counts not yet recorded in the flight recorder
+  uint32_t _recordTime = 0;
+
+  volatile uint32_t _interval;
+  volatile bool _fastSampling = false;
+  absolute_time_t _slowDownTime = 0;
+
   void inline _readPosition();
-  uint32_t inline _grayToBinary(uint32_t gray);
-  virtual void _loop();
+  bool _decodeFrame(uint32_t word, uint32_t &position);
+  bool _plausible(uint32_t position, absolute_time_t now);
+  int32_t _wrap(int32_t diff);
+  void _adaptUpdateInterval(int32_t diff);
+  void _recordDiff(int32_t diff, bool flush = false);
+  void _learn(int32_t diff);
+  bool _readCorrection();
+  void _replaceCorrection(const int16_t *correction);
+  void _loop();
+
+  /**
+   * @brief Entry of the correction table for a position, from its
+   *        single-turn bits
+   */
+  inline uint32_t _correctionBin(uint32_t position) {
+    return (position & ((1u << _setup.resolutionBits) - 1)) >> _correctionShift;
+  }
+
+  /**
+   * @brief Convert gray code to binary
+   *
+   * Each binary bit is the parity of the gray bits above it, which
+   * a prefix XOR works out in five shifts whatever the value.
+   * 
+   * @param gray Gray code encoded value
+   * @return uint32_t The decoded binary value
+   **/
+  inline uint32_t _grayToBinary(uint32_t gray) {
+    uint32_t binary = gray;
+
+    binary ^= binary >> 1;
+    binary ^= binary >> 2;
+    binary ^= binary >> 4;
+    binary ^= binary >> 8;
+    binary ^= binary >> 16;
+
+    return binary;
+  }
+
+  /**
+   * @brief Parity of a word, 1 when an odd number of bits are set
+   */
+  inline uint32_t _parity(uint32_t word) {
+    word ^= word >> 16;
+    word ^= word >> 8;
+    word ^= word >> 4;
+    word ^= word >> 2;
+    word ^= word >> 1;
+
+    return word & 1;
+  }
 };
 
 
@@ -78,13 +343,19 @@ enum EncoderDirection {
  * Use the setSpeed method to set the speed in RPM of the 
  * simulated encoder. The direction method can be used to set
  * the direction of the simulated encoder.
+ *
+ * Nothing is virtual; begin() and the loop hide the encoder's
+ * own, so the simulator must be used through its own type.
  */
 class EncoderSimulator : public Encoder {
   friend bool _encoderSimulatorTimerCallback(repeating_timer_t *rt);
 public:
   EncoderSimulator(EncoderSetup setup) : Encoder(setup) {}
 
-  virtual void begin() override;
+  void begin();
+  void resume(int64_t position);
+  void retime() {}
+  void pause(bool) {}
 
   void speed(float speed);
   float speed();
@@ -100,6 +371,6 @@ protected:
   float _stepsPerInterval;
   float _internalPosition;
 
-  virtual void _loop() override;
+  void _loop();
 };
 
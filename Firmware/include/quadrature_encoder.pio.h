@@ -0,0 +1,96 @@
+// Assembled from the quadrature_encoder program in the Raspberry Pi
+// pico-examples (BSD-3-Clause). Kept pre-assembled so that the build
+// does not depend on pioasm.
+//
+// The program continuously shifts the previous and current state of
+// the two phase pins into ISR and performs a computed jump into the
+// table below, which increments or decrements Y as needed. The count
+// in Y is pushed to the RX FIFO without blocking on every loop, and a
+// loop takes at most 10 cycles, so it can follow step rates of up to
+// clk_sys / 10.
+
+#pragma once
+
+#include "hardware/pio.h"
+#include "hardware/clocks.h"
+
+#define quadrature_encoder_wrap_target 15
+#define quadrature_encoder_wrap 23
+
+static const uint16_t quadrature_encoder_program_instructions[] = {
+  0x000f, //  0: jmp    15              ; 00 -> 00
+  0x000e, //  1: jmp    14              ; 00 -> 01
+  0x0015, //  2: jmp    21              ; 00 -> 10
+  0x000f, //  3: jmp    15              ; 00 -> 11
+  0x0015, //  4: jmp    21              ; 01 -> 00
+  0x000f, //  5: jmp    15              ; 01 -> 01
+  0x000f, //  6: jmp    15              ; 01 -> 10
+  0x000e, //  7: jmp    14              ; 01 -> 11
+  0x000e, //  8: jmp    14              ; 10 -> 00
+  0x000f, //  9: jmp    15              ; 10 -> 01
+  0x000f, // 10: jmp    15              ; 10 -> 10
+  0x0015, // 11: jmp    21              ; 10 -> 11
+  0x000f, // 12: jmp    15              ; 11 -> 00
+  0x0015, // 13: jmp    21              ; 11 -> 01
+  0x008f, // 14: jmp    y--, 15         ; 11 -> 10, decrement
+          //     .wrap_target
+  0xa0c2, // 15: mov    isr, y          ; 11 -> 11, update
+  0x8000, // 16: push   noblock
+  0x60c2, // 17: out    isr, 2
+  0x4002, // 18: in     pins, 2
+  0xa0e6, // 19: mov    osr, isr
+  0xa0a6, // 20: mov    pc, isr
+  0xa04a, // 21: mov    y, !y           ; increment
+  0x0097, // 22: jmp    y--, 23
+  0xa04a, // 23: mov    y, !y
+          //     .wrap
+};
+
+static const struct pio_program quadrature_encoder_program = {
+  .instructions = quadrature_encoder_program_instructions,
+  .length = 24,
+  .origin = 0, // Computed jumps require the program to be loaded at address 0
+};
+
+static inline pio_sm_config quadrature_encoder_program_get_default_config(uint offset) {
+  pio_sm_config c = pio_get_default_sm_config();
+  sm_config_set_wrap(&c, offset + quadrature_encoder_wrap_target, offset + quadrature_encoder_wrap);
+  return c;
+}
+
+/**
+ * @brief The clock divider that slows the state machine down to the
+ *        given step rate at the current system clock
+ */
+static inline float quadrature_encoder_clkdiv(uint32_t maxStepRate) {
+  if (maxStepRate == 0) {
+    return 1.0;
+  }
+
+  return (float)clock_get_hz(clk_sys) / (10 * maxStepRate);
+}
+
+/**
+ * @brief Start counting on the given state machine
+ *
+ * @param pin The A phase; the B phase must be on the next pin
+ * @param maxStepRate Highest expected step rate, used to slow the
+ *        state machine down and filter glitches. 0 samples at full speed.
+ */
+static inline void quadrature_encoder_program_init(PIO pio, uint sm, uint pin, uint32_t maxStepRate) {
+  pio_sm_set_consecutive_pindirs(pio, sm, pin, 2, false);
+  gpio_pull_up(pin);
+  gpio_pull_up(pin + 1);
+
+  pio_sm_config c = quadrature_encoder_program_get_default_config(0);
+
+  sm_config_set_in_pins(&c, pin);
+  sm_config_set_jmp_pin(&c, pin);
+  sm_config_set_in_shift(&c, false, false, 32);
+  sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_NONE);
+
+  sm_config_set_clkdiv(&c, quadrature_encoder_clkdiv(maxStepRate));
+
+  pio_sm_init(pio, sm, 0, &c);
+  pio_sm_set_enabled(pio, sm, true);
+}
@@ -0,0 +1,148 @@
+"""
+Lists the flash-resident functions that the RAM-resident hot path can
+reach, since any of them can stall the motion loop on an XIP cache miss.
+
+Every function linked into SRAM (those marked __not_in_flash_func) is
+taken as a root, and direct calls, tail calls and long-branch veneers
+are followed through the disassembly. Calls through function pointers
+can't be followed and are not reported.
+
+Runs after every build of the pico environments as a PlatformIO extra
+script, or by hand:
+
+    python scripts/xip_audit.py .pio/build/pico/firmware.elf
+
+Set XIP_AUDIT_STRICT=1 to fail the build when anything is reported.
+"""
+
+import os
+import re
+import subprocess
+import sys
+
+
+FLASH = (0x10000000, 0x11000000)
+SRAM = (0x20000000, 0x20042000)
+
+FUNCTION = re.compile(r"^([0-9a-f]{8}) <(.+)>:$")
+BRANCH = re.compile(r"^\s*[0-9a-f]+:\s+b(?:l|lx)?(?:eq|ne|cs|cc|mi|pl|vs|vc|hi|ls|ge|lt|gt|le)?(?:\.[nw])?\s+([0-9a-f]+) <(.+)>$")
+LITERAL = re.compile(r"^\s*[0-9a-f]+:\s+.*\.word\s+0x([0-9a-f]{8})")
+
+
+def in_range(address, region):
+    return region[0] <= address < region[1]
+
+
+def disassemble(objdump, elf):
+    """
+    Maps the address of each function to its name and
+    to the set of function addresses that it branches to
+    """
+    output = subprocess.run(
+        [objdump, "-d", "-C", "--no-show-raw-insn", elf],
+        check=True, capture_output=True, text=True,
+    ).stdout
+
+    names = {}
+    calls = {}
+    current = None
+
+    for line in output.splitlines():
+        match = FUNCTION.match(line)
+
+        if match:
+            current = int(match.group(1), 16)
+            names[current] = match.group(2)
+            calls[current] = set()
+            continue
+
+        if current is None:
+            continue
+
+        # Branches within a function are shown as an offset from
+        # its start, so only those to another symbol are calls
+
+        match = BRANCH.match(line)
+
+        if match and "+0x" not in match.group(2):
+            target = int(match.group(1), 16)
+
+            if target != current:
+                calls[current].add(target)
+            continue
+
+        # Veneers load the address they jump to from a literal
+
+        match = LITERAL.match(line)
+
+        if match and "veneer" in names[current]:
+            calls[current].add(int(match.group(1), 16) & ~1)
+
+    return names, calls
+
+
+def audit(objdump, elf):
+    names, calls = disassemble(objdump, elf)
+
+    roots = [address for address in names if in_range(address, SRAM) and "veneer" not in names[address]]
+    callers = {}
+    pending = list(roots)
+
+    for root in roots:
+        callers[root] = None
+
+    while pending:
+        address = pending.pop()
+
+        for target in calls.get(address, ()):
+            if target not in callers:
+                callers[target] = address
+                pending.append(target)
+
+    reported = sorted(
+        (address for address in callers if in_range(address, FLASH) and "veneer" not in names.get(address, "")),
+        key=lambda address: names.get(address, ""),
+    )
+
+    print("XIP audit: %d functions in RAM, %d flash functions reachable from them" % (len(roots), len(reported)))
+
+    for address in reported:
+        # Show the first RAM function on the way to each one, which
+        # is usually the place where something needs to change
+
+        caller = callers[address]
+
+        while caller is not None and (not in_range(caller, SRAM) or "veneer" in names[caller]):
+            caller = callers[caller]
+
+        print("  %08x %s  (from %s)" % (address, names.get(address, "?"), names.get(caller, "?")))
+
+    return len(reported)
+
+
+def main(argv):
+    if len(argv) < 2:
+        print("usage: xip_audit.py firmware.elf [objdump]")
+        return 2
+
+    objdump = argv[2] if len(argv) > 2 else "arm-none-eabi-objdump"
+    reported = audit(objdump, argv[1])
+
+    return 1 if reported and os.environ.get("XIP_AUDIT_STRICT") else 0
+
+
+try:
+    Import("env")
+except NameError:
+    env = None
+
+if env is not None:
+    def _post_build(target, source, env):
+        objdump = env.subst("$CC").replace("gcc", "objdump")
+
+        if audit(objdump, str(target[0])) and os.environ.get("XIP_AUDIT_STRICT"):
+            env.Exit(1)
+
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", _post_build)
+elif __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,131 @@
+#include <ClockProfiles.hpp>
+
+
+void ClockProfiles::begin() {
+  // The board starts at the nominal clock
+
+  _profile = ClockNominal;
+  _restTime = get_absolute_time();
+}
+
+void ClockProfiles::loop() {
+  MachineLeadscrew &leadscrew = _setup.leadscrew;
+
+  if (leadscrew.engaged() || leadscrew.cycle() || leadscrew.jogging() || _setup.tachometer.speed() != 0) {
+    _restTime = get_absolute_time();
+  }
+
+  const ClockProfile target = _setup.automatic ? _target() : _forced;
+
+  if (target == _profile || !_quiet()) {
+    return;
+  }
+
+  if (_apply(target)) {
+    _switches++;
+  } else {
+    _failures++;
+  }
+}
+
+void ClockProfiles::force(ClockProfile profile) {
+  _forced = profile;
+  _setup.automatic = false;
+}
+
+void ClockProfiles::automatic() {
+  _setup.automatic = true;
+}
+
+/**
+ * @brief The idle profile is only used after a while at rest, and
+ *        the high speed one is kept until the spindle has slowed down
+ *        well below the speed that selected it
+ */
+ClockProfile ClockProfiles::_target() {
+  const float speed = fabsf(_setup.tachometer.speed());
+
+  if (speed == 0 && absolute_time_diff_us(_restTime, get_absolute_time()) > int64_t(_setup.idleDelay) * 1000000) {
+    return ClockIdle;
+  }
+
+  const float threshold = _profile == ClockHighSpeed ? _setup.highSpeedRPM * CLOCK_PROFILES_HYSTERESIS : _setup.highSpeedRPM;
+
+  return speed >= threshold ? ClockHighSpeed : ClockNominal;
+}
+
+/**
+ * @brief Whether the clock can be changed without disturbing a
+ *        move. A feed ramps down after disengaging, and a cycle
+ *        engages on its own, so neither is ever quiet. Engaged with
+ *        the spindle stopped is fine, as there is nothing to step
+ *        until it starts.
+ */
+bool ClockProfiles::_quiet() {
+  MachineLeadscrew &leadscrew = _setup.leadscrew;
+
+  if (leadscrew.jogging() || leadscrew.feeding() || leadscrew.cycle()) {
+    return false;
+  }
+
+  return !leadscrew.engaged() || _setup.tachometer.speed() == 0;
+}
+
+bool ClockProfiles::_apply(ClockProfile profile) {
+  const uint32_t khz = _setup.khz[profile];
+  const uint32_t previousHz = clock_get_hz(clk_sys);
+  const bool boost = khz > CLOCK_PROFILES_MAX_NOMINAL_KHZ;
+
+  // The voltage goes up before the clock does, and down after
+
+  if (boost) {
+    vreg_set_voltage(CLOCK_PROFILES_BOOST_VOLTAGE);
+    busy_wait_us_32(CLOCK_PROFILES_VREG_SETTLE);
+  }
+
+  // The encoder is not read while its SPI clock is moving
+
+  _setup.encoder.pause(true);
+
+  if (!set_sys_clock_khz(khz, false)) {
+    _setup.encoder.pause(false);
+
+    if (previousHz <= CLOCK_PROFILES_MAX_NOMINAL_KHZ * 1000) {
+      vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+    }
+
+    return false;
+  }
+
+  if (!boost) {
+    vreg_set_voltage(VREG_VOLTAGE_DEFAULT);
+  }
+
+  // Changing the system clock also moves the peripheral clock
+  // onto it, which would tie the SPI rate to the profile
+
+  clock_configure(clk_peri, 0, CLOCKS_CLK_PERI_CTRL_AUXSRC_VALUE_CLKSRC_PLL_USB, 48 * MHZ, 48 * MHZ);
+
+  _retime(float(clock_get_hz(clk_sys)) / float(previousHz));
+  _setup.encoder.pause(false);
+  _profile = profile;
+
+  return true;
+}
+
+void ClockProfiles::_retime(float factor) {
+  _setup.encoder.retime();
+
+  if (_setup.feedback) {
+    _setup.feedback->retime();
+  }
+
+  if (_setup.handwheel) {
+    _setup.handwheel->retime();
+  }
+
+  // The loop's speed follows the clock, and is measured again
+  // the next time the leadscrew moves
+
+  _setup.leadscrew.scaleMaxStepRate(factor);
+}
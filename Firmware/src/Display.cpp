@@ -1,4 +1,5 @@
 #include <Display.hpp>  
+#include <FlightRecorder.hpp>
 #include <algorithm>
 
 
@@ -26,29 +27,137 @@ void Display::begin() {
   _metricIndex = _setup.defaultMetricThreadIndex;
   _tpiPitch(_setup.tpiThreads[_tpiIndex]);
   _metricPitch(_setup.metricThreads[_metricIndex]);
-  powerFeedIPR(_setup.defaultIPR);
+  _powerFeed(_setup.defaultIPR);
+  _feedIPM = _setup.defaultIPM;
+  _feedMMPM = _setup.defaultMMPM;
+  _leadscrew.cycleLength(_setup.defaultCycleLength);
   mode(TPI);
 
   add_repeating_timer_ms(_setup.displayLoopIntervalMs, _displayTimerCallback, this, &_timer);
 }
 
+/**
+ * @brief Show a short message, holding off regular
+ *        updates until it has been on screen for a while.
+ */
+void Display::_message(const char *text) {
+  _display.clearDisplay();
+  _display.setDisplayToString(text);
+  _messageUntil = make_timeout_time_ms(_setup.displayMessageIntervalMs);
+}
+
 void Display::_updateIndicators() {
   if (_sleeping) {
     return;
   }
 
+  if (absolute_time_diff_us(get_absolute_time(), _messageUntil) > 0) {
+    return;
+  }
+
   uint8_t indicators = 0;
 
+  switch(_mode) {
+    case TPI:
+      indicators |= TPIMode;
+      break;
+
+    case Metric:
+      indicators |= MetricMode;
+      break;
+
+    case Powerfeed:
+      indicators |= PowerfeedMode;
+      break;
+
+    case FeedPerMinute:
+      indicators |= PowerfeedMode | (_feedMetric ? MetricMode : TPIMode);
+      break;
+  }
+
+  uint32_t speed = _tachometer.speed();
+
+  // Chip breaking shares the cycle indicator, since there
+  // is no threading cycle while feeding
+
+  if (_leadscrew.cycle() || (_mode == Powerfeed && _leadscrew.chipBreaking())) {
+    indicators |= Cycle;
+  }
+
+  if (_diagnostics) {
+    _showDiagnostics(speed);
+  } else if (_leadscrew.jogging()) {
+    _showJog();
+  } else if (_leadscrew.cycle()) {
+    // During a threading cycle, show the pass length
+    // instead of the pitch and the pass count instead
+    // of the spindle speed
+
+    _updateCycle();
+  } else {
+    _showPitch();
+
+    // While the spindle is stopped, show the fastest it
+    // can turn for the selected pitch, marked with a dot
+
+    const bool showLimit = speed == 0 && !_leadscrew.feeding();
+    uint32_t speedDisplay = showLimit ? std::min(_leadscrew.maxSafeRPM(), 9999.0f) : speed;
+
+    for (int i = 7; i >= 4; i--) {
+      _display.setDisplayDigit(speedDisplay % 10, i, showLimit && i == 7);
+      speedDisplay /= 10;
+    }
+  }
+
+  if (_leadscrew.engaged()) {
+    indicators |= Engaged;
+  }
+
+  if (_leadscrew.faults()) {
+    indicators |= ErrorA;
+  }
+
+  if (_leadscrew.stepRateWarning()) {
+    indicators |= ErrorB;
+  }
+
+  if (_leadscrew.starts() > 1 && _threading()) {
+    indicators |= MultiStart;
+  }
+
+  _display.setLEDs(indicators);
+
+  // A feed independent of the spindle, or the handwheel,
+  // keeps the display awake
+
+  if (speed == 0 && !(_leadscrew.feeding() && _leadscrew.engaged()) && !_leadscrew.jogging()) {
+    if (!_idle) {
+      _idle = true;
+      _idleStartTime = get_absolute_time();
+    } else if (absolute_time_diff_us(_idleStartTime, get_absolute_time()) > _setup.displayAutoOffInterval * 1000000) {
+      _display.setLEDs(0);
+      _display.setDisplayToString("SLEEPING");
+      _sleeping = true;
+      _leadscrew.engage(false);
+    }
+  } else {
+    _idle = false;
+  }
+}
+
+void Display::_showPitch() {
   switch(_mode) {
     case TPI: {
-        uint8_t value = round(_tpiThread);
+        // Fractional pitches can only be set over the serial
+        // port and are shown with a single decimal
+
+        const bool fractional = _tpiThread != roundf(_tpiThread);
+        uint32_t value = round(fractional ? _tpiThread * 10 : _tpiThread);
 
         for (int i = 3; i >= 0; i--) {
-          _display.setDisplayDigit(value % 10, i, false);
+          _display.setDisplayDigit(value % 10, i, fractional && i == 2);
           value /= 10;
         }
-
-        indicators |= TPIMode;
       }
       break;
 
@@ -59,8 +168,6 @@ void Display::_updateIndicators() {
           _display.setDisplayDigit(value % 10, i, i == 1);
           value /= 10;
         }
-
-        indicators |= MetricMode;
       }
       break;
 
@@ -71,39 +178,47 @@ void Display::_updateIndicators() {
           _display.setDisplayDigit(value % 10, i, i == 0);
           value /= 10;
         }
+      }
+      break;
+
+    case FeedPerMinute: {
+        // Tenths of an inch or whole millimetres, with the
+        // leftmost digit showing the direction
+
+        uint32_t value = std::min<uint32_t>(round(_feedMetric ? _feedMMPM : _feedIPM * 10), 999);
 
-        indicators |= PowerfeedMode;
+        for (int i = 3; i >= 1; i--) {
+          _display.setDisplayDigit(value % 10, i, !_feedMetric && i == 2);
+          value /= 10;
+        }
+
+        _display.setDisplayToString(_feedDirection < 0 ? "-" : " ", 0, 0);
       }
       break;
   }
+}
 
-  uint32_t speed = _tachometer.speed();
-  uint32_t speedDisplay = speed;
+void Display::_updateCycle() {
+  uint32_t value;
+  int dot;
 
-  for (int i = 7; i >= 4; i--) {
-    _display.setDisplayDigit(speedDisplay % 10, i, false);
-    speedDisplay /= 10;
+  if (_mode == Metric) {
+    value = round(_leadscrew.cycleLength() * 254);    // Tenths of a millimetre
+    dot = 2;
+  } else {
+    value = round(_leadscrew.cycleLength() * 1000);   // Thousandths of an inch
+    dot = 0;
   }
 
-  if (_leadscrew.engaged()) {
-    indicators |= Engaged;
+  for (int i = 3; i >= 0; i--) {
+    _display.setDisplayDigit(value % 10, i, i == dot);
+    value /= 10;
   }
 
-  _display.setLEDs(indicators);
+  char passes[5];
 
-  if (speed == 0) {
-    if (!_idle) {
-      _idle = true;
-      _idleStartTime = get_absolute_time();
-    } else if (absolute_time_diff_us(_idleStartTime, get_absolute_time()) > _setup.displayAutoOffInterval * 1000000) {
-      _display.setLEDs(0);
-      _display.setDisplayToString("SLEEPING");
-      _sleeping = true;
-      _leadscrew.engage(false);
-    }
-  } else {
-    _idle = false;
-  }
+  snprintf(passes, sizeof(passes), "P%3lu", (unsigned long)std::min<uint32_t>(_leadscrew.cyclePasses(), 999));
+  _display.setDisplayToString(passes, 0, 4);
 }
 
 void Display::_readButtons() {
@@ -111,24 +226,19 @@ void Display::_readButtons() {
 
   uint32_t buttons = _display.getButtons();
 
-  _buttonPressQueue.push_front(buttons);
+  // Only proceed once the buttons have read the
+  // same a number of times in a row
 
-  if (_buttonPressQueue.size() > _setup.displayButtonQueueSize) {
-    _buttonPressQueue.pop_back();
-  } else if (_buttonPressQueue.size() < _setup.displayButtonQueueSize) {
-    return;
+  if (buttons != _buttons) {
+    _buttons = buttons;
+    _buttonReadings = 0;
   }
 
-  // Only proceed if all the button press values
-  // in the queue are the same
-
-  for (auto it = _buttonPressQueue.begin(); it != _buttonPressQueue.end(); it++) {
-    if (*it != buttons) {
-      return;
-    }
+  if (++_buttonReadings < _setup.displayButtonQueueSize) {
+    return;
   }
 
-  _buttonPressQueue.clear();
+  _buttonReadings = 0;
 
   if (!buttons) {
     _lastButtonPress = 0;
@@ -142,8 +252,84 @@ void Display::_readButtons() {
   }
 
   if (absolute_time_diff_us(_lastButtonPress, now) > 250000) { // 250ms repeat rate
+    if (buttons) {
+      _lastButtonPress = now;
+    }
+
+    // Button combinations are handled first and removed
+    // from the set so that they don't also act on their own
+
+    if ((buttons & (Increase | Decrease)) == (Increase | Decrease)) {
+      // Pressing both arrows together freezes the flight recorder
+      // so that the events leading up to a bad pass are preserved
+
+      flightRecorder.freeze(FreezeButton);
+      _message("FROZEN");
+      buttons &= ~(Increase | Decrease);
+    }
+
+    if ((buttons & (SetTPIMode | SetPowerfeedMode)) == (SetTPIMode | SetPowerfeedMode)) {
+      _toggleDiagnostics();
+      buttons &= ~(SetTPIMode | SetPowerfeedMode);
+    }
+
+    if ((buttons & (SetMetricMode | SetPowerfeedMode)) == (SetMetricMode | SetPowerfeedMode)) {
+      _toggleJog();
+      buttons &= ~(SetMetricMode | SetPowerfeedMode);
+    }
+
+    // While jogging the arrows step through the multipliers,
+    // engaging ends jogging and everything else is ignored
+
+    if (_leadscrew.jogging()) {
+      if (buttons & Increase) {
+        _leadscrew.jogMultiplier(std::min<uint32_t>(_leadscrew.jogMultiplier() * 10, DISPLAY_MAX_JOG_MULTIPLIER));
+      }
+
+      if (buttons & Decrease) {
+        _leadscrew.jogMultiplier(std::max<uint32_t>(_leadscrew.jogMultiplier() / 10, 1));
+      }
+
+      if (buttons & Engage) {
+        _toggleJog();
+      }
+
+      buttons = 0;
+    }
+
+    // On the diagnostics page the arrows step through the
+    // figures, and everything else but engaging is ignored
+
+    if (_diagnostics) {
+      if (buttons & Increase) {
+        _diagnosticsPage = (_diagnosticsPage + 1) % DiagnosticsPageCount;
+      }
+
+      if (buttons & Decrease) {
+        _diagnosticsPage = (_diagnosticsPage + DiagnosticsPageCount - 1) % DiagnosticsPageCount;
+      }
+
+      buttons &= Engage;
+    }
+
+    if ((buttons & (Starts | NextStart)) == (Starts | NextStart)) {
+      _toggleCycle();
+      buttons &= ~(Starts | NextStart);
+    }
+
     if (buttons & Engage) {
-      _leadscrew.engage(!_leadscrew.engaged());
+      if (_leadscrew.faults()) {
+        // A fault disengages the leadscrew and must be
+        // acknowledged before it can be engaged again
+
+        _leadscrew.clearFaults();
+        _message(_leadscrew.faults() & EmergencyStopFault ? "E-STOP" : "RESET");
+      } else if (!_leadscrew.engaged() && _tachometer.speed() > _leadscrew.maxSafeRPM()) {
+        // The leadscrew refuses to engage above this speed
+        _message("TOO FAST");
+      } else {
+        _leadscrew.engage(!_leadscrew.engaged());
+      }
     }
 
     if (buttons & Increase) {
@@ -154,6 +340,28 @@ void Display::_readButtons() {
       _decrease();
     }
 
+    if (buttons & Starts) {
+      if (_mode == Powerfeed) {
+        _toggleChipBreaking();
+      } else {
+        _cycleStarts();
+      }
+    }
+
+    if (buttons & NextStart) {
+      if (_mode == FeedPerMinute) {
+        _reverseFeed();
+      } else {
+        _nextStart();
+      }
+    }
+
+    // The pitch can't change under a threading cycle
+
+    if (_leadscrew.cycle()) {
+      buttons &= ~(SetTPIMode | SetMetricMode | SetPowerfeedMode);
+    }
+
     if (buttons & SetTPIMode) {
       mode(TPI);
     }
@@ -163,18 +371,25 @@ void Display::_readButtons() {
     }
 
     if (buttons & SetPowerfeedMode) {
-      mode(Powerfeed);
-    }
-
-    if (buttons) {
-      _lastButtonPress = now;
+      _cycleFeedMode();
     }
   }
 }
 
 void Display::_loop() {
+  _leadscrew.spindleSpeed(_tachometer.speed());
+
+  if (_held) {
+    return;
+  }
+
   if (absolute_time_diff_us(lastDisplayUpdateUs, get_absolute_time()) > _setup.displayUpdateIntervalMs * 1000) {
     lastDisplayUpdateUs = get_absolute_time();
+
+    if (_diagnostics) {
+      _measureDiagnostics();
+    }
+
     _updateIndicators();
   }
 
@@ -186,6 +401,8 @@ void Display::mode(DisplayMode mode) {
   _mode = mode;
   critical_section_exit(&_cs);
 
+  flightRecorder.record(EventMode, int32_t(mode));
+
   switch (mode) {
     case TPI:
       _leadscrew.threadTPI(_tpiThread);
@@ -198,6 +415,10 @@ void Display::mode(DisplayMode mode) {
     case Powerfeed:
       _leadscrew.powerFeedIPR(_powerFeedIPR);
       break;
+
+    case FeedPerMinute:
+      _leadscrew.feedPerMinute(_feedDirection * (_feedMetric ? _feedMMPM / 25.4f : _feedIPM));
+      break;
   }
 }
 
@@ -212,39 +433,244 @@ DisplayMode Display::mode() {
 }
 
 void Display::_increase() {
+  if (_leadscrew.cycle()) {
+    _adjustCycleLength(1);
+    return;
+  }
+
   switch(_mode) {
     case TPI:
-      _tpiIndex = std::clamp(_tpiIndex + 1, 0, int(_setup.tpiThreads.size() - 1));
+      _tpiIndex = std::clamp(_tpiIndex + 1, 0, int(_setup.tpiThreadCount - 1));
       _tpiPitch(_setup.tpiThreads[_tpiIndex]);
       break;
 
     case Metric:
-      _metricIndex = std::clamp(_metricIndex + 1, 0, int(_setup.metricThreads.size() - 1));
+      _metricIndex = std::clamp(_metricIndex + 1, 0, int(_setup.metricThreadCount - 1));
       _metricPitch(_setup.metricThreads[_metricIndex]);
       break;
 
     case Powerfeed:
-      powerFeedIPR(_powerFeedIPR + 0.001);
+      _powerFeed(_powerFeedIPR + 0.001);
+      break;
+
+    case FeedPerMinute:
+      _feedPerMinute(_feedMetric ? _feedMMPM + _setup.mmpmStep : _feedIPM + _setup.ipmStep);
       break;
   }
 }
 
 void Display::_decrease() {
+  if (_leadscrew.cycle()) {
+    _adjustCycleLength(-1);
+    return;
+  }
+
   switch(_mode) {
     case TPI:
-      _tpiIndex = std::clamp(_tpiIndex - 1, 0, int(_setup.tpiThreads.size() - 1));
+      _tpiIndex = std::clamp(_tpiIndex - 1, 0, int(_setup.tpiThreadCount - 1));
       _tpiPitch(_setup.tpiThreads[_tpiIndex]);
       break;
 
     case Metric:
-      _metricIndex = std::clamp(_metricIndex - 1, 0, int(_setup.metricThreads.size() - 1));
+      _metricIndex = std::clamp(_metricIndex - 1, 0, int(_setup.metricThreadCount - 1));
       _metricPitch(_setup.metricThreads[_metricIndex]);
       break;
 
     case Powerfeed:
-      powerFeedIPR(_powerFeedIPR - 0.001);
+      _powerFeed(_powerFeedIPR - 0.001);
+      break;
+
+    case FeedPerMinute:
+      _feedPerMinute(_feedMetric ? _feedMMPM - _setup.mmpmStep : _feedIPM - _setup.ipmStep);
+      break;
+  }
+}
+
+void Display::_toggleCycle() {
+  if (_leadscrew.cycle()) {
+    _leadscrew.cycle(false);
+    _message("CYCLE OF");
+    return;
+  }
+
+  if (!_threading() || _leadscrew.engaged()) {
+    return;
+  }
+
+  if (_leadscrew.cycle(true)) {
+    _message("CYCLE ON");
+  }
+}
+
+void Display::_adjustCycleLength(int direction) {
+  // Lengths are adjusted in the units of the current mode
+
+  if (_mode == Metric) {
+    const float step = _setup.cycleLengthStepMillimeters;
+    const float length = std::clamp(_leadscrew.cycleLength() * 25.4f + direction * step, step, 999.9f);
+
+    _leadscrew.cycleLength(length / 25.4f);
+  } else {
+    const float step = _setup.cycleLengthStepInches;
+    const float length = std::clamp(_leadscrew.cycleLength() + direction * step, step, 9.999f);
+
+    _leadscrew.cycleLength(length);
+  }
+}
+
+void Display::_cycleStarts() {
+  if (!_threading()) {
+    return;
+  }
+
+  _leadscrew.starts(_leadscrew.starts() % _setup.maxStarts + 1);
+  _showStart();
+}
+
+void Display::_nextStart() {
+  if (!_threading() || _leadscrew.starts() < 2) {
+    return;
+  }
+
+  _leadscrew.start(_leadscrew.start() + 1);
+  _showStart();
+}
+
+/**
+ * @brief The interval, pause and retract are set over the serial
+ *        port; the display only turns chip breaking on and off.
+ */
+void Display::_toggleChipBreaking() {
+  _leadscrew.chipBreaking(!_leadscrew.chipBreaking());
+  _message(_leadscrew.chipBreaking() ? "CHIP ON" : "CHIP OFF");
+}
+
+void Display::_showStart() {
+  char text[9];
+
+  snprintf(text, sizeof(text), "St %u-%u", _leadscrew.start() + 1, _leadscrew.starts());
+  _message(text);
+}
+
+/**
+ * @brief Jogging can only start while disengaged and outside of
+ *        a threading cycle
+ */
+void Display::_toggleJog() {
+  if (_leadscrew.jogging()) {
+    _leadscrew.jog(false);
+    _message("JOG OFF");
+    return;
+  }
+
+  _leadscrew.jog(true);
+
+  if (!_leadscrew.jogging()) {
+    _message("NO JOG");
+  }
+}
+
+void Display::_showJog() {
+  char text[9];
+
+  snprintf(text, sizeof(text), "JOG %4lu", (unsigned long)_leadscrew.jogMultiplier());
+  _display.setDisplayToString(text);
+}
+
+void Display::_toggleDiagnostics() {
+  _diagnostics = !_diagnostics;
+
+  if (!_diagnostics) {
+    return;
+  }
+
+  // Peaks are taken from the moment the page is opened
+
+  _diagnosticsTime = get_absolute_time();
+  _lastWatchdog = _leadscrew.watchdog();
+  _lastSamples = _encoder.samples();
+  _lastSteps = _leadscrew.stepper().steps();
+  _peakStepRate = 0;
+  _leadscrew.clearMaxLoopLatency();
+
+  _message("DIAG");
+}
+
+void Display::_measureDiagnostics() {
+  const absolute_time_t now = get_absolute_time();
+  const float seconds = absolute_time_diff_us(_diagnosticsTime, now) / 1000000.0f;
+
+  if (seconds <= 0) {
+    return;
+  }
+
+  const uint32_t watchdog = _leadscrew.watchdog();
+  const uint32_t samples = _encoder.samples();
+  const uint32_t steps = _leadscrew.stepper().steps();
+
+  _loopRate = (watchdog - _lastWatchdog) / seconds;
+  _encoderRate = (samples - _lastSamples) / seconds;
+  _stepRate = (steps - _lastSteps) / seconds;
+  _peakStepRate = std::max(_peakStepRate, _stepRate);
+
+  _diagnosticsTime = now;
+  _lastWatchdog = watchdog;
+  _lastSamples = samples;
+  _lastSteps = steps;
+}
+
+void Display::_showDiagnostics(float speed) {
+  const char *label = "";
+  float value = 0;
+
+  switch (_diagnosticsPage) {
+    case DiagnosticsLoopRate:
+      label = "LP";
+      value = _loopRate / 1000;
+      break;
+
+    case DiagnosticsLoopLatency:
+      label = "LAt";
+      value = _leadscrew.maxLoopLatency();
+      break;
+
+    case DiagnosticsEncoderRate:
+      label = "En";
+      value = _encoderRate / 1000;
+      break;
+
+    case DiagnosticsStepRate:
+      label = "SP";
+      value = _stepRate;
+      break;
+
+    case DiagnosticsPeakStepRate:
+      label = "PSP";
+      value = _peakStepRate;
+      break;
+
+    case DiagnosticsHeadroom:
+      label = "Hr";
+      value = std::clamp(100 * (1 - speed / _leadscrew.maxSafeRPM()), 0.0f, 100.0f);
+      break;
+
+    case DiagnosticsFollowingError:
+      label = "FE";
+      value = _leadscrew.followingError();
+      break;
+
+    case DiagnosticsDeadlineMisses:
+      label = "dL";
+      value = _encoder.deadlineMisses();
       break;
   }
+
+  // A three character label followed by five digits
+
+  char text[9];
+
+  snprintf(text, sizeof(text), "%-3s%5ld", label, lroundf(std::clamp(value, -9999.0f, 99999.0f)));
+  _display.setDisplayToString(text);
 }
 
 void Display::_tpiPitch(float pitch) {
@@ -257,7 +683,74 @@ void Display::_metricPitch(float pitch) {
   _leadscrew.threadMetric(_metricThread);
 }
 
-void Display::powerFeedIPR(float feedRate) {
+void Display::_powerFeed(float feedRate) {
   _powerFeedIPR = std::clamp(feedRate, _setup.minIPR, _setup.maxIPR);
   _leadscrew.powerFeedIPR(_powerFeedIPR);
 }
+
+void Display::_feedPerMinute(float feedRate) {
+  if (_feedMetric) {
+    _feedMMPM = std::clamp(feedRate, _setup.minMMPM, _setup.maxMMPM);
+  } else {
+    _feedIPM = std::clamp(feedRate, _setup.minIPM, _setup.maxIPM);
+  }
+
+  _leadscrew.feedPerMinute(_feedDirection * (_feedMetric ? _feedMMPM / 25.4f : _feedIPM));
+}
+
+/**
+ * @brief The Powerfeed button steps from the feed per revolution
+ *        to feeds per minute in inches, then in millimetres.
+ */
+void Display::_cycleFeedMode() {
+  if (_mode == Powerfeed) {
+    _feedMetric = false;
+    mode(FeedPerMinute);
+    _message("IN-MIN");
+  } else if (_mode == FeedPerMinute && !_feedMetric) {
+    _feedMetric = true;
+    mode(FeedPerMinute);
+    _message("MM-MIN");
+  } else {
+    mode(Powerfeed);
+  }
+}
+
+/**
+ * @brief Without the spindle to follow, the direction of the
+ *        feed is chosen with the NextStart button.
+ */
+void Display::_reverseFeed() {
+  _feedDirection = -_feedDirection;
+  mode(FeedPerMinute);
+  _message(_feedDirection > 0 ? "FEED FWD" : "FEED REV");
+}
+
+void Display::threadTPI(float tpi) {
+  _tpiThread = tpi;
+  mode(TPI);
+}
+
+void Display::threadMetric(float pitch) {
+  _metricThread = pitch;
+  mode(Metric);
+}
+
+void Display::powerFeedIPR(float feedRate) {
+  _powerFeedIPR = feedRate;
+  mode(Powerfeed);
+}
+
+void Display::feedIPM(float feedRate) {
+  _feedIPM = fabsf(feedRate);
+  _feedDirection = feedRate < 0 ? -1 : 1;
+  _feedMetric = false;
+  mode(FeedPerMinute);
+}
+
+void Display::feedMMPM(float feedRate) {
+  _feedMMPM = fabsf(feedRate);
+  _feedDirection = feedRate < 0 ? -1 : 1;
+  _feedMetric = true;
+  mode(FeedPerMinute);
+}
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include <EmergencyStop.hpp>
+#include <FlightRecorder.hpp>
+#include "hardware/irq.h"
+
+
+static EmergencyStop *_emergencyStopInstance = nullptr;
+
+void __not_in_flash_func(_emergencyStopIRQ)() {
+  const pin_size_t pin = _emergencyStopInstance->_setup.pin;
+  const uint32_t edge = _emergencyStopInstance->_setup.tripHigh ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
+
+  if (gpio_get_irq_event_mask(pin) & edge) {
+    gpio_acknowledge_irq(pin, edge);
+    _emergencyStopInstance->_trip();
+  }
+}
+
+void EmergencyStop::begin() {
+  _emergencyStopInstance = this;
+
+  critical_section_init_with_lock_num(&_cs, 3);
+
+  // With the pull-up, a broken wire to a normally closed
+  // switch trips the input just like pressing it does
+
+  gpio_init(_setup.pin);
+  gpio_set_dir(_setup.pin, GPIO_IN);
+  gpio_pull_up(_setup.pin);
+
+  _lastReleased = time_us_32();
+
+  // The interrupt is routed to the core that enables it, and
+  // is given priority over the encoder's timer on that core
+
+  gpio_add_raw_irq_handler(_setup.pin, _emergencyStopIRQ);
+  gpio_set_irq_enabled(_setup.pin, _setup.tripHigh ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL, true);
+  irq_set_priority(IO_IRQ_BANK0, PICO_HIGHEST_IRQ_PRIORITY);
+  irq_set_enabled(IO_IRQ_BANK0, true);
+
+  // No edge is seen if the input is already active
+
+  if (active()) {
+    _trip();
+  }
+}
+
+void __not_in_flash_func(EmergencyStop::_trip)() {
+  // Inhibit first and keep the books afterwards
+
+  gpio_set_outover(_setup.pulsePin, GPIO_OVERRIDE_LOW);
+
+  const uint32_t now = time_us_32();
+
+  critical_section_enter_blocking(&_cs);
+
+  // Set again, in case a reset on the other core released
+  // the output while this was waiting for the lock
+
+  gpio_set_outover(_setup.pulsePin, GPIO_OVERRIDE_LOW);
+
+  const bool tripped = _tripped;
+
+  if (!tripped) {
+    _acknowledged = false;
+  }
+
+  _tripped = true;
+  critical_section_exit(&_cs);
+
+  if (tripped) {
+    return;
+  }
+
+  const uint32_t reactionTime = now - _lastReleased;
+
+  _trips = _trips + 1;
+  _reactionTime = reactionTime;
+
+  if (reactionTime > _maxReactionTime) {
+    _maxReactionTime = reactionTime;
+  }
+
+  flightRecorder.record(EventEmergencyStop, int32_t(reactionTime));
+}
+
+void __not_in_flash_func(EmergencyStop::acknowledge)() {
+  critical_section_enter_blocking(&_cs);
+  _acknowledged = _tripped;
+  critical_section_exit(&_cs);
+}
+
+bool EmergencyStop::reset() {
+  bool released = false;
+
+  critical_section_enter_blocking(&_cs);
+
+  if (!active() && (!_tripped || _acknowledged)) {
+    _tripped = false;
+    gpio_set_outover(_setup.pulsePin, GPIO_OVERRIDE_NORMAL);
+    released = true;
+  }
+
+  critical_section_exit(&_cs);
+
+  return released;
+}
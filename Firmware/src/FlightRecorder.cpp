@@ -0,0 +1,161 @@
+#include <FlightRecorder.hpp>
+#include <MemoryMonitor.hpp>
+#include <LittleFS.h>
+#include <algorithm>
+
+
+static const char *_eventNames[] = {
+  "encoder",
+  "step",
+  "ratio",
+  "mode",
+  "engage",
+  "deadline-miss",
+  "freeze",
+  "fault",
+  "correction",
+  "start",
+  "cycle",
+  "take-up",
+  "feed-rate",
+  "encoder-frame",
+  "emergency-stop",
+  "jog",
+  "chip-break",
+};
+
+
+void FlightRecorder::begin() {
+  LittleFS.begin();
+}
+
+void __not_in_flash_func(FlightRecorder::freeze)(FlightRecorderFreezeReason reason) {
+  record(EventFreeze, int32_t(reason));
+  _frozen = true;
+}
+
+void FlightRecorder::resume() {
+  const uint32_t status = save_and_disable_interrupts();
+  _head[0] = 0;
+  _head[1] = 0;
+  restore_interrupts(status);
+
+  _saved = false;
+  _frozen = false;
+}
+
+/**
+ * @brief Walk the entries of both cores in chronological order
+ *
+ * Each ring is already sorted by time, so the two are merged
+ * on the fly instead of being copied into a temporary buffer.
+ */
+template <typename Callback>
+void FlightRecorder::_forEachEntry(Callback callback) {
+  uint32_t index[2];
+  uint32_t end[2];
+
+  for (int core = 0; core < 2; core++) {
+    end[core] = _head[core];
+    index[core] = end[core] > FLIGHT_RECORDER_CAPACITY ? end[core] - FLIGHT_RECORDER_CAPACITY : 0;
+  }
+
+  while (index[0] != end[0] || index[1] != end[1]) {
+    int core;
+
+    if (index[0] == end[0]) {
+      core = 1;
+    } else if (index[1] == end[1]) {
+      core = 0;
+    } else {
+      const FlightRecorderEntry &first = _entries[0][index[0] & (FLIGHT_RECORDER_CAPACITY - 1)];
+      const FlightRecorderEntry &second = _entries[1][index[1] & (FLIGHT_RECORDER_CAPACITY - 1)];
+
+      // Compare as a signed difference so that the 32-bit
+      // microsecond counter can wrap around
+
+      core = int32_t(second.time - first.time) < 0 ? 1 : 0;
+    }
+
+    callback(_entries[core][index[core]++ & (FLIGHT_RECORDER_CAPACITY - 1)]);
+  }
+}
+
+void FlightRecorder::_print(Print &output, const FlightRecorderEntry &entry) {
+  const char *name = entry.event < sizeof(_eventNames) / sizeof(_eventNames[0]) ? _eventNames[entry.event] : "unknown";
+
+  char line[48];
+  int length;
+
+  if (entry.event == EventRatio || entry.event == EventCorrection || entry.event == EventFeedRate) {
+    length = snprintf(line, sizeof(line), "%lu,%u,%s,%f\r\n", (unsigned long)entry.time, entry.core, name, entry.fvalue);
+  } else {
+    length = snprintf(line, sizeof(line), "%lu,%u,%s,%ld\r\n", (unsigned long)entry.time, entry.core, name, (long)entry.value);
+  }
+
+  output.write((const uint8_t *)line, std::min<size_t>(length, sizeof(line) - 1));
+}
+
+void FlightRecorder::dump(Print &output) {
+  if (!_frozen) {
+    freeze(FreezeManual);
+  }
+
+  output.println("time_us,core,event,value");
+
+  _forEachEntry([&](const FlightRecorderEntry &entry) {
+    _print(output, entry);
+  });
+}
+
+void FlightRecorder::dumpSaved(Print &output) {
+  AllocationPermit permit; // LittleFS allocates its file handles
+
+  File file = LittleFS.open(_setup.path, "r");
+
+  if (!file) {
+    output.println("No saved recording");
+    return;
+  }
+
+  output.println("time_us,core,event,value");
+
+  FlightRecorderEntry entry;
+
+  while (file.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+    _print(output, entry);
+  }
+
+  file.close();
+}
+
+/**
+ * @brief Save a frozen recording to the flash filesystem
+ *
+ * Writing to flash stalls the other core, so this must only
+ * be called while the carriage is at rest.
+ *
+ * @return true if a recording was written
+ */
+bool FlightRecorder::save() {
+  if (!_frozen || _saved) {
+    return false;
+  }
+
+  AllocationPermit permit; // LittleFS allocates its file handles
+
+  File file = LittleFS.open(_setup.path, "w");
+
+  if (!file) {
+    return false;
+  }
+
+  _forEachEntry([&](const FlightRecorderEntry &entry) {
+    file.write((const uint8_t *)&entry, sizeof(entry));
+  });
+
+  file.close();
+  _saved = true;
+
+  return true;
+}
@@ -1,55 +1,854 @@
-#include <leadscrew.hpp>
+#include <Leadscrew.hpp>
+#include <FlightRecorder.hpp>
+#include <algorithm>
 
-void Leadscrew::begin() {
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::begin() {
   critical_section_init_with_lock_num(&_cs, 10);
-}
 
-void Leadscrew::loop() {
-  LeadscrewState state;
+  _jogMaxLag = _setup.handwheelMaxLag * _stepsPerInch();
+}
 
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::loop() {
   while(1) {
-    // Read the current state variables and
-    // write the spindle speed
+    _iterate();
+  }
+}
+
+/**
+ * @brief Run a single iteration of the loop
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_iterate() {
+  if (_setup.emergencyStop) {
+    _setup.emergencyStop->poll(time_us_32());
+
+    // The trip is only acknowledged once its fault is raised,
+    // so that it cannot be reset before the loop has seen it
+
+    if (_setup.emergencyStop->pending()) {
+      _emergencyStop();
+      _setup.emergencyStop->acknowledge();
+    }
+  }
+
+  // Read the current state variables and
+  // write the spindle speed
+
+  critical_section_enter_blocking(&_cs);
+  LeadscrewState state = _guardedState;
+  _watchdog++;
+
+  // In a threading cycle the start's phase is applied when
+  // each pass is engaged, so pending shifts are dropped
+
+  float phaseShift = 0;
+
+  if (state.cycle) {
+    _pendingPhaseShift = 0;
+  } else if (state.engaged) {
+    phaseShift = _pendingPhaseShift;
+    _pendingPhaseShift = 0;
+  }
+
+  const bool cycleConfirmed = _cycleConfirmed;
+  _cycleConfirmed = false;
+
+  const bool cycleResumed = _cycleResumed;
+  LeadscrewCycle resumedCycle;
+
+  if (cycleResumed) {
+    resumedCycle = _resumedCycle;
+    _cycleResumed = false;
+  }
+
+  const LeadscrewFault pendingFault = _pendingFault;
+  _pendingFault = NoFault;
+  critical_section_exit(&_cs);
+
+  if (cycleResumed) {
+    _resumeCycle(resumedCycle);
+  }
+
+  if (pendingFault != NoFault) {
+    _fault(pendingFault);
+    state.engaged = false;
+    state.cycle = false;
+  }
+
+  // Only a feed independent of the spindle can carry on
+  // once its position can no longer be trusted
 
+  if ((state.engaged || state.cycle) && state.feedRate == 0 && _encoder.lost()) {
+    _fault(EncoderFault);
+    state.engaged = false;
+    state.cycle = false;
+  }
+
+  if (state.cycle) {
+    _cycle(state, cycleConfirmed);
+  } else if (_cycleState != CycleOff) {
+    _cycleState = CycleOff;
+  }
+
+  // The cycle is published as a whole, so that the other core
+  // never saves a reference from one pass with another's state
+
+  if (_cycleState != _guardedCycle.state) {
     critical_section_enter_blocking(&_cs);
-    state = _guardedState;
-    _watchdog++;
+    _guardedCycle.state = _cycleState;
+    _guardedCycle.direction = _cycleDirection;
+    _guardedCycle.passes = _cyclePasses;
+    _guardedCycle.reference = _cycleReference;
+    _guardedCycle.startPosition = _cycleStart;
     critical_section_exit(&_cs);
+  }
+
+  // If the leadscrew is not engaged and there is no move
+  // in progress, do nothing. Outside of a threading cycle,
+  // a move is dropped as soon as the leadscrew disengages.
+
+  // A feed that ignores the spindle is brought to a stop
+  // instead, since it may be running at speed
+
+  const bool feeding = state.engaged && state.feedRate != 0;
+
+  if (_ramp.running() && !feeding) {
+    _ramp.run(0);
+  } else if (!state.engaged && !state.cycle && state.jogStepsPerCount == 0 && !_ramp.idle()) {
+    _ramp.reset();
+  }
+
+  if (state.jogStepsPerCount != 0) {
+    if (!_wasJogging) {
+      _jogCount = _setup.handwheel->count();
+      _jogTime = time_us_32();
+      _jogRate = 0;
+    }
+
+    _jog(state.jogStepsPerCount);
+  }
+
+  _wasJogging = state.jogStepsPerCount != 0;
+
+  if (!state.engaged && _ramp.idle()) {
+    if (_wasActive) {
+      _stepper.recordSteps();
+    }
+
+    _wasActive = false;
+    _wasEngaged = false;
+    _stepRateIterations = 0;
+    return;
+  }
+
+  const uint32_t now = time_us_32();
+
+  if (state.engaged && !_wasEngaged) {
+    _interpolationRemaining = 0;
+    _residual = 0;
+    _lastSampleTime = now;
+    _wasBreakingChips = false;
+  }
+
+  _wasEngaged = state.engaged;
+
+  // A change of start is fed in through the ramp, so that
+  // the carriage moves to the new phase without losing steps
+
+  if (phaseShift != 0 && !feeding) {
+    _ramp.moveBy(phaseShift * state.spindleToLeadScrewRatio);
+  }
+
+  // Calculate the next desired position based on the
+  // number of steps recorded by the encoder and the
+  // ratio of the leadscrew to the spindle
+
+  _stepper.enabled(true);
+
+  if (feeding) {
+    _ramp.run(state.feedRate);
+  }
+
+  float increment = _ramp.advance(now);
+
+  // The encoder is still read while feeding, so that its
+  // counts don't build up for when the spindle is followed
+
+  if (state.engaged) {
+    int32_t positionDifference = _encoder.positionDifference();
+
+    // Counts that fall in a chip break are dropped before they
+    // are interpolated. A break that is turned off while backed
+    // off still moves the carriage back.
+
+    const bool breakingChips = state.chipBreakFeed > 0 && !feeding;
+
+    if (breakingChips) {
+      positionDifference = _chipBreak(positionDifference, state);
+    } else if (_chipRetracted != 0) {
+      _ramp.moveBy(-_chipRetracted);
+      _chipRetracted = 0;
+    }
+
+    _wasBreakingChips = breakingChips;
+
+    if (!feeding) {
+      increment += _interpolate(positionDifference, state.spindleToLeadScrewRatio, now);
+    }
+  }
+
+  // Only whole steps are added to the desired position; the
+  // fractions are kept apart so that they aren't rounded away
+  // once the desired position grows large
+
+  _residual += increment;
+
+  const float wholeSteps = truncf(_residual);
+
+  if (wholeSteps != 0) {
+    _residual -= wholeSteps;
+    _stepper.desiredPosition = _stepper.desiredPosition + wholeSteps;
+  }
+
+  if (_setup.feedback && !_wasActive) {
+    _feedbackOrigin(now);
+  }
+
+  _wasActive = true;
+  _activeIterations = _activeIterations + 1;
+
+  // Loop the stepper; this moves the motor if needed
+
+  _stepper.loop();
+
+  if (_setup.feedback) {
+    _updateFollowingError(now);
+  }
+
+  _measureStepRate(now);
+}
+
+/**
+ * @brief Turn the handwheel's counts into moves of the ramp. Turning
+ *        the wheel quickly scales each detent up, and the carriage
+ *        never trails the wheel by more than the maximum lag, so it
+ *        stops soon after the wheel does.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_jog(float stepsPerCount) {
+  const uint32_t now = time_us_32();
+  const uint32_t elapsed = now - _jogTime;
+
+  if (elapsed < LEADSCREW_JOG_INTERVAL) {
+    return;
+  }
+
+  const int32_t count = _setup.handwheel->count();
+  const int32_t counts = count - _jogCount;
+
+  _jogCount = count;
+  _jogTime = now;
+
+  // A single reading holds too few counts for a steady rate
+
+  const float detents = float(counts) / _setup.handwheelCountsPerDetent;
+
+  _jogRate = _jogRate * 0.75f + fabsf(detents) * 1000000.0f / float(elapsed) * 0.25f;
+
+  if (counts == 0) {
+    return;
+  }
+
+  const float scale = std::clamp(_jogRate / _setup.handwheelFastRate, 1.0f, _setup.handwheelMaxScale);
+  const float remaining = _ramp.remaining();
+  const float target = std::clamp(remaining + float(counts) * stepsPerCount * scale, -_jogMaxLag, _jogMaxLag);
+
+  _ramp.moveBy(target - remaining);
+}
+
+/**
+ * @brief Split the spindle's motion between feeding and pausing
+ *        for chip breaks. Each phase is counted in encoder counts,
+ *        and counts left over at the end of one are carried into the
+ *        next, so the breaks never drift from their interval.
+ *
+ * @return The part of the encoder counts that is to be fed
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline int32_t Leadscrew<EncoderT, StepperT, FeedbackT>::_chipBreak(int32_t positionDifference, const LeadscrewState &state) {
+  if (!_wasBreakingChips) {
+    _chipPhase = ChipFeeding;
+    _chipRemaining = state.chipBreakFeed;
+  }
+
+  int32_t counts = abs(positionDifference);
+  int32_t fed = 0;
+
+  while (true) {
+    if (_chipPhase == ChipFeeding) {
+      const int32_t feed = std::min(counts, _chipRemaining);
+
+      fed += feed;
+      counts -= feed;
+      _chipRemaining -= feed;
+
+      if (_chipRemaining > 0) {
+        break;
+      }
+
+      // Back off against the direction that was being fed
+
+      if (state.chipBreakRetract != 0) {
+        const float direction = float(positionDifference) * state.spindleToLeadScrewRatio;
+
+        _chipRetracted = copysignf(state.chipBreakRetract, -direction);
+        _ramp.moveBy(_chipRetracted);
+      }
+
+      _chipBreaks = _chipBreaks + 1;
+      _chipPhase = ChipPausing;
+      _chipRemaining = state.chipBreakDwell;
+
+      flightRecorder.record(EventChipBreak, int32_t(_chipBreaks));
+    } else if (_chipPhase == ChipPausing) {
+      const int32_t pause = std::min(counts, _chipRemaining);
 
-    // If the leadscrew is not engaged, do nothing
+      counts -= pause;
+      _chipRemaining -= pause;
 
-    if (!state.engaged) {
-      continue;
+      if (_chipRemaining > 0 || !_ramp.idle()) {
+        break;
+      }
+
+      if (_chipRetracted != 0) {
+        _ramp.moveBy(-_chipRetracted);
+        _chipRetracted = 0;
+        _chipPhase = ChipReturning;
+        break;
+      }
+
+      _chipPhase = ChipFeeding;
+      _chipRemaining = state.chipBreakFeed;
+    } else {
+      if (!_ramp.idle()) {
+        break;
+      }
+
+      _chipPhase = ChipFeeding;
+      _chipRemaining = state.chipBreakFeed;
     }
+  }
+
+  return positionDifference < 0 ? -fed : fed;
+}
+
+/**
+ * @brief Time the iterations that do real work, over windows of
+ *        continuous activity, to find the step engine's capacity.
+ *        The longest gap between two of them is kept as well.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_measureStepRate(uint32_t now) {
+  if (_stepRateIterations == 0) {
+    _stepRateWindowStart = now;
+  } else if (now - _lastIterationTime > _maxLoopLatency) {
+    _maxLoopLatency = now - _lastIterationTime;
+  }
+
+  _lastIterationTime = now;
+  _stepRateIterations++;
+
+  const uint32_t elapsed = now - _stepRateWindowStart;
+
+  if (elapsed >= LEADSCREW_STEP_RATE_WINDOW) {
+    _maxStepRate = float(_stepRateIterations - 1) * 1000000.0f / float(elapsed) / 2;
+
+    // The next window starts from this iteration
+
+    _stepRateWindowStart = now;
+    _stepRateIterations = 1;
+  }
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::maxSafeRPM() {
+  if (_state.feedRate != 0) {
+    return INFINITY;
+  }
+
+  const float stepsPerRevolution = fabsf(_state.spindleToLeadScrewRatio) * _encoder.stepsPerRevolution();
+
+  if (stepsPerRevolution == 0) {
+    return INFINITY;
+  }
+
+  return _maxStepRate * 60 / stepsPerRevolution;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::spindleSpeed(float rpm) {
+  _spindleSpeed = rpm;
+
+  if (engaged() && rpm > maxSafeRPM()) {
+    // The fault is raised by the loop, which owns the
+    // state that has to be reset along with it
+
+    critical_section_enter_blocking(&_cs);
+    _pendingFault = OverspeedFault;
+    critical_section_exit(&_cs);
+  }
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+bool Leadscrew<EncoderT, StepperT, FeedbackT>::stepRateWarning() {
+  if (_state.feedRate != 0) {
+    return fabsf(_state.feedRate) > _maxStepRate * _setup.stepRateWarning;
+  }
+
+  return _spindleSpeed > maxSafeRPM() * _setup.stepRateWarning;
+}
+
+/**
+ * @brief Spread the steps produced by each encoder sample evenly
+ *        over the time it is expected to take for the next one to
+ *        arrive, instead of releasing them all at once.
+ *
+ * The expected time is the interval between the last two samples
+ * that moved, which follows the spindle speed. Whatever is left over
+ * when a new sample arrives is carried into it, so the leadscrew
+ * trails the spindle by at most one sample.
+ *
+ * @return The number of steps to add to the desired position
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline float Leadscrew<EncoderT, StepperT, FeedbackT>::_interpolate(int32_t positionDifference, float ratio, uint32_t now) {
+  if (_setup.interpolationMaxInterval == 0) {
+    return float(positionDifference) * ratio;
+  }
+
+  if (positionDifference != 0) {
+    // Both bounds can be tuned while running, so the lower one
+    // wins should they ever cross
+
+    const uint32_t shortest = _encoder.updateInterval();
+    const uint32_t longest = std::max(shortest, _setup.interpolationMaxInterval);
+    const uint32_t interval = std::clamp<uint32_t>(now - _lastSampleTime, shortest, longest);
+
+    _lastSampleTime = now;
+    _interpolationRemaining += float(positionDifference) * ratio;
+    _interpolationRate = _interpolationRemaining / float(interval);
+    _interpolationTime = now;
+  }
+
+  if (_interpolationRemaining == 0) {
+    return 0;
+  }
+
+  float steps = _interpolationRate * float(now - _interpolationTime);
+
+  _interpolationTime = now;
+
+  if (fabsf(steps) >= fabsf(_interpolationRemaining)) {
+    steps = _interpolationRemaining;
+  }
+
+  _interpolationRemaining -= steps;
+
+  return steps;
+}
+
+/**
+ * @brief Engage or disengage from within the loop.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_engaged(bool engaged) {
+  critical_section_enter_blocking(&_cs);
+  _guardedState.engaged = engaged;
+  critical_section_exit(&_cs);
+
+  flightRecorder.record(EventEngage, int32_t(engaged));
+}
+
+/**
+ * @brief Offset, in encoder counts, between the spindle and the
+ *        phase at which the current start must be engaged,
+ *        normalized to within half a revolution either way.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline int32_t Leadscrew<EncoderT, StepperT, FeedbackT>::_cycleOffset(int64_t position) {
+  const int32_t countsPerRevolution = _encoder.stepsPerRevolution();
+
+  int32_t offset = int32_t((position - _cycleReference - int64_t(_phase)) % countsPerRevolution);
+
+  if (offset > countsPerRevolution / 2) {
+    offset -= countsPerRevolution;
+  } else if (offset <= -countsPerRevolution / 2) {
+    offset += countsPerRevolution;
+  }
+
+  return offset;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_cycle(LeadscrewState &state, bool confirmed) {
+  switch (_cycleState) {
+    case CycleOff:
+      break;
+
+    case CycleReady:
+      if (confirmed) {
+        // The first pass is engaged straight away and sets
+        // the spindle phase that every later pass must match
+
+        _cycleStart = _stepper.position;
+        _stepper.desiredPosition = _cycleStart;
+        _cycleReference = _encoder.clearPositionDifference() - int64_t(_phase);
+
+        _engaged(true);
+        state.engaged = true;
+
+        _cycleState = CycleCutting;
+      }
+      break;
+
+    case CycleCutting:
+      if (fabs(_stepper.position - _cycleStart) >= state.cycleLength) {
+        if (_cyclePasses == 0) {
+          _cycleDirection = _stepper.position >= _cycleStart ? 1 : -1;
+        }
+
+        _engaged(false);
+        state.engaged = false;
+
+        _stepper.desiredPosition = _stepper.position;
+        _ramp.moveBy(_cycleStart - _stepper.position);
+
+        _cyclePasses = _cyclePasses + 1;
+        _cycleState = CycleReturning;
+      }
+      break;
+
+    case CycleReturning:
+      if (_ramp.idle()) {
+        _cycleState = CycleWaitingForInfeed;
+      }
+      break;
+
+    case CycleWaitingForInfeed:
+      if (confirmed && _stepper.position != _cycleStart) {
+        // Only after resuming an interrupted pass; the carriage
+        // is brought back first, and the next pass confirmed again
+
+        _stepper.desiredPosition = _stepper.position;
+        _ramp.moveBy(_cycleStart - _stepper.position);
+
+        _cycleState = CycleReturning;
+      } else if (confirmed) {
+        _cycleLastOffset = _cycleOffset(_encoder.cumulativePosition());
+        _cycleState = CycleWaitingForSync;
+      }
+      break;
+
+    case CycleWaitingForSync: {
+        // Engage as the spindle crosses the thread's phase in the
+        // cutting direction, accounting for the counts by which
+        // it has already gone past it
+
+        const int32_t offset = _cycleOffset(_encoder.cumulativePosition());
+
+        if (_cycleLastOffset * _cycleDirection < 0 && offset * _cycleDirection >= 0) {
+          const int32_t engagedOffset = _cycleOffset(_encoder.clearPositionDifference());
+
+          _stepper.desiredPosition = _cycleStart + float(engagedOffset) * state.spindleToLeadScrewRatio;
+
+          _engaged(true);
+          state.engaged = true;
+
+          _cycleState = CycleCutting;
+        }
+
+        _cycleLastOffset = offset;
+      }
+      break;
+  }
+}
+
+/**
+ * @brief Take up a cycle handed over by resumeCycle(). One that
+ *        never got past its start point is simply armed again.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_resumeCycle(const LeadscrewCycle &cycle) {
+  _cycleReference = cycle.reference;
+  _cycleStart = cycle.startPosition;
+  _cycleDirection = cycle.direction;
+  _cyclePasses = cycle.passes;
+
+  if (cycle.state == CycleReady || (cycle.passes == 0 && _stepper.position == _cycleStart)) {
+    _cycleState = CycleReady;
+    return;
+  }
+
+  // The direction is otherwise only known once a pass is complete
+
+  if (cycle.passes == 0) {
+    _cycleDirection = _stepper.position >= _cycleStart ? 1 : -1;
+  }
+
+  _cycleState = CycleWaitingForInfeed;
+}
+
+/**
+ * @brief Line up the feedback encoder with the stepper. The motor
+ *        holds its position while disengaged, so this is done
+ *        every time the leadscrew is engaged.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_feedbackOrigin(uint32_t now) {
+  _feedbackOriginCount = _setup.feedback->count();
+  _feedbackOriginPosition = _stepper.position;
+  _feedbackOriginBacklash = _stepper.backlashOffset();
+
+  for (uint8_t i = 0; i < LEADSCREW_FEEDBACK_HISTORY; i++) {
+    _feedbackHistory[i] = _stepper.position;
+  }
+
+  _feedbackHistoryTime = now;
+  _correctionTime = now;
+  _correctionBudget = _setup.feedbackMaxCorrection;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_updateFollowingError(uint32_t now) {
+  // Convert the feedback count into the stepper position
+  // that the motor has actually reached
+
+  float actualPosition = _feedbackOriginPosition +
+                         float(_setup.feedback->count() - _feedbackOriginCount) / _setup.feedbackCountsPerStep;
+
+  // A motor encoder also counts the backlash take-up steps,
+  // which the carriage never sees
+
+  if (_setup.feedbackOnMotor) {
+    actualPosition -= _stepper.backlashOffset() - _feedbackOriginBacklash;
+  }
+
+  const float followingError = _stepper.desiredPosition - actualPosition;
+
+  _followingError = followingError;
+
+  if (fabs(followingError) > _maxFollowingError) {
+    _maxFollowingError = fabs(followingError);
+  }
+
+  if (fabs(followingError) > _setup.feedbackTolerance) {
+    _fault(FollowingErrorFault);
+    return;
+  }
+
+  // The feedback trails the pulses, so the motor may be anywhere
+  // the stepper was over the last lag. Keep a position every
+  // fraction of it, the oldest one being at least that old.
+
+  if ((now - _feedbackHistoryTime) * (LEADSCREW_FEEDBACK_HISTORY - 1) >= _setup.feedbackLag) {
+    _feedbackHistoryTime = now;
+    _feedbackHistoryIndex = (_feedbackHistoryIndex + 1) % LEADSCREW_FEEDBACK_HISTORY;
+    _feedbackHistory[_feedbackHistoryIndex] = _stepper.position;
+  }
+
+  float low = _stepper.position;
+  float high = _stepper.position;
+
+  for (uint8_t i = 0; i < LEADSCREW_FEEDBACK_HISTORY; i++) {
+    low = std::min(low, _feedbackHistory[i]);
+    high = std::max(high, _feedbackHistory[i]);
+  }
+
+  // Only steps missing beyond that are lost. They are handed
+  // back to the stepper so that they are issued again, at no
+  // more than the correction rate.
+
+  const float lostSteps = actualPosition < low ? low - actualPosition :
+                          actualPosition > high ? high - actualPosition : 0;
+
+  _correctionBudget = std::min(_correctionBudget + float(now - _correctionTime) * _setup.feedbackCorrectionRate / 1000000,
+                               _setup.feedbackMaxCorrection);
+  _correctionTime = now;
 
-    // Calculate the next desired position based on the
-    // number of steps recorded by the encoder and the
-    // ratio of the leadscrew to the spindle
+  if (fabs(lostSteps) > _setup.feedbackDeadband && _correctionBudget >= 1) {
+    const float correction = truncf(std::clamp(lostSteps, -_correctionBudget, _correctionBudget));
 
-    _stepper.enabled(true);
-    _stepper.desiredPosition = _stepper.desiredPosition + float(_encoder.positionDifference()) * state.spindleToLeadScrewRatio;
+    _stepper.position = _stepper.position - correction;
+    _correctionBudget -= fabsf(correction);
+    _corrections = _corrections + 1;
 
-    // Loop the stepper; this moves the motor if needed
+    // The re-issued steps are not in flight yet, so the
+    // positions kept are moved along with the stepper's
 
-    _stepper.loop();
+    for (uint8_t i = 0; i < LEADSCREW_FEEDBACK_HISTORY; i++) {
+      _feedbackHistory[i] -= correction;
+    }
+
+    flightRecorder.record(EventCorrection, int32_t(correction));
   }
 }
 
-void Leadscrew::engage(bool engage) {
+/**
+ * @brief Disengage from within the loop and latch the fault
+ *        until it is explicitly cleared.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_fault(LeadscrewFault fault) {
   critical_section_enter_blocking(&_cs);
-  _guardedState.engaged = engage;
+  _guardedState.engaged = false;
+  _guardedState.cycle = false;
+  _guardedState.jogStepsPerCount = 0;
+  _faults = _faults | fault;
+  critical_section_exit(&_cs);
+
+  _updateSampling();
+
+  _stepper.recordSteps();
+  flightRecorder.record(EventFault, int32_t(fault));
+  flightRecorder.freeze(FreezeFault);
+}
+
+/**
+ * @brief The step output has already been inhibited by the
+ *        emergency stop's interrupt. Everything that would still
+ *        move the motor is dropped, so nothing is left to go out
+ *        once the output is released.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+__force_inline void Leadscrew<EncoderT, StepperT, FeedbackT>::_emergencyStop() {
+  _fault(EmergencyStopFault);
+
+  _ramp.reset();
+  _residual = 0;
+  _interpolationRemaining = 0;
   _stepper.desiredPosition = _stepper.position;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::clearFaults() {
+  // An emergency stop stays latched while its input is active,
+  // and until the loop has raised its fault
+
+  const bool stopped = _setup.emergencyStop && !_setup.emergencyStop->reset();
+
+  // Faults are raised by the loop under the same lock, so that
+  // none raised in the meantime is cleared without being seen
+
+  critical_section_enter_blocking(&_cs);
+  _faults = stopped ? EmergencyStopFault : NoFault;
+  critical_section_exit(&_cs);
+
+  if (!stopped) {
+    _maxFollowingError = 0;
+  }
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::engage(bool engage) {
+  // A latched fault must be cleared before engaging again, and
+  // the spindle, or the feed, must be slow enough for the stepper
+
+  if (engage && (_faults || _spindleSpeed > maxSafeRPM() || fabsf(_state.feedRate) > _maxStepRate)) {
+    return;
+  }
+
+  if (engage && jogging()) {
+    return;
+  }
+
+  // During a threading cycle the loop engages on its own;
+  // engaging confirms the next pass and disengaging aborts
+
+  if (cycle()) {
+    const ThreadingCycleState cycleState = _cycleState;
+
+    if (engage && (cycleState == CycleReady || cycleState == CycleWaitingForInfeed)) {
+      critical_section_enter_blocking(&_cs);
+      _cycleConfirmed = true;
+      critical_section_exit(&_cs);
+    } else {
+      cycle(false);
+    }
+
+    return;
+  }
+
+  // Full rate sampling is requested before engaging, so that
+  // the first samples the loop sees are already at full rate
+
+  if (engage) {
+    _updateSampling(true);
+  }
+
+  // The faults are checked again under the lock, in case the
+  // loop has raised one since
+
+  critical_section_enter_blocking(&_cs);
+  const bool refused = engage && _faults;
+
+  if (!refused) {
+    _guardedState.engaged = engage;
+    _stepper.desiredPosition = _stepper.position;
+  }
   critical_section_exit(&_cs);
 
+  _updateSampling();
+
+  if (refused) {
+    return;
+  }
+
   _encoder.positionDifference(); // Clear the position difference
-  _state.engaged = engage;
+
+  flightRecorder.record(EventEngage, int32_t(engage));
 }
 
-bool Leadscrew::engaged() {
-  return _state.engaged;
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+bool Leadscrew<EncoderT, StepperT, FeedbackT>::engaged() {
+  bool result;
+
+  critical_section_enter_blocking(&_cs);
+  result = _guardedState.engaged;
+  critical_section_exit(&_cs);
+
+  return result;
 }
 
-void Leadscrew::powerFeedIPR(float feedRate) {
+/**
+ * @brief The loop counts its active iterations, so that a move made
+ *        and finished between two calls still restarts the wait
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+bool Leadscrew<EncoderT, StepperT, FeedbackT>::atRest(uint32_t settleTime) {
+  critical_section_enter_blocking(&_cs);
+  const bool idle = !_guardedState.engaged && _guardedState.jogStepsPerCount == 0 && !_cycleConfirmed;
+  critical_section_exit(&_cs);
+
+  // A cycle is only at rest while it waits on the operator; once
+  // a pass is confirmed it engages by itself
+
+  const ThreadingCycleState cycleState = _cycleState;
+  const bool waiting = cycleState == CycleOff || cycleState == CycleReady || cycleState == CycleWaitingForInfeed;
+  const uint32_t iterations = _activeIterations;
+
+  if (!idle || !waiting || _spindleSpeed != 0 || iterations != _restIterations) {
+    _restIterations = iterations;
+    _restTime = get_absolute_time();
+    return false;
+  }
+
+  return absolute_time_diff_us(_restTime, get_absolute_time()) >= int64_t(settleTime) * 1000;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::powerFeedIPR(float feedRate) {
   // Calculate the lead screw to spindle ratio based on the feed rate,
   // the leadscrew pitch, the lead screw reduction factor,
   // and the ratio of steps per revolution of the encoder to the
@@ -64,14 +863,11 @@ void Leadscrew::powerFeedIPR(float feedRate) {
                                   _setup.leadScrewReductionFactor / 100 * 
                                   _stepper.stepsPerRevolution() / _encoder.stepsPerRevolution();
 
-  _state.spindleToLeadScrewRatio = spindleToLeadScrewRatio;
-
-  critical_section_enter_blocking(&_cs);
-  _guardedState.spindleToLeadScrewRatio = spindleToLeadScrewRatio;
-  critical_section_exit(&_cs);
+  _spindleToLeadScrewRatio(spindleToLeadScrewRatio, false);
 }
 
-float Leadscrew::powerFeedIPR() {
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::powerFeedIPR() {
   // Back-calculate the feed rate based on the lead screw to spindle ratio,
   // the leadscrew pitch, the lead screw reduction factor,
   // and the ratio of steps per revolution of the encoder to the
@@ -81,7 +877,8 @@ float Leadscrew::powerFeedIPR() {
           (_setup.leadscrewPitch * _setup.leadScrewReductionFactor / 100 * _stepper.stepsPerRevolution());
 }
 
-void Leadscrew::threadTPI(uint8_t tpi) {
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::threadTPI(float tpi) {
   // Calculate the lead screw to spindle ratio based on the TPI,
   // the lead screw reduction factor,
   // and the ratio of steps per revolution of the encoder to the
@@ -93,18 +890,15 @@ void Leadscrew::threadTPI(uint8_t tpi) {
   // LS reduction factor *                  // multiplied by the reduction factor between the input shaft of the LS and the screw
   // stepper res / encoder res              // multiplied by the ratio of steps per revolution of the encoder to the steps per revolution of the stepper
 
-  float spindleToLeadScrewRatio = _setup.leadscrewPitch / float(tpi) *
+  float spindleToLeadScrewRatio = _setup.leadscrewPitch / tpi *
                                   _setup.leadScrewReductionFactor / 100 * 
                                   _stepper.stepsPerRevolution() / _encoder.stepsPerRevolution();
 
-  _state.spindleToLeadScrewRatio = spindleToLeadScrewRatio;
-
-  critical_section_enter_blocking(&_cs);
-  _guardedState.spindleToLeadScrewRatio = spindleToLeadScrewRatio;
-  critical_section_exit(&_cs);
+  _spindleToLeadScrewRatio(spindleToLeadScrewRatio, true);
 }
 
-float Leadscrew::threadTPI() {
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::threadTPI() {
   // Back-calculate the TPI based on the lead screw to spindle ratio,
   // the lead screw reduction factor,
   // and the ratio of steps per revolution of the encoder to the
@@ -114,7 +908,8 @@ float Leadscrew::threadTPI() {
         (_state.spindleToLeadScrewRatio * _encoder.stepsPerRevolution());
 }
 
-void Leadscrew::threadMetric(float pitch) {
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::threadMetric(float pitch) {
   // Calculate the lead screw to spindle ratio based on the pitch,
   // the lead screw reduction factor,
   // and the ratio of steps per revolution of the encoder to the
@@ -125,14 +920,11 @@ void Leadscrew::threadMetric(float pitch) {
   const float reducedRatio = ratio * _setup.leadScrewReductionFactor / 100;
   const float spindleToLeadScrewRatio = reducedRatio * _stepper.stepsPerRevolution() / _encoder.stepsPerRevolution();
 
-  _state.spindleToLeadScrewRatio = spindleToLeadScrewRatio;
-
-  critical_section_enter_blocking(&_cs);
-  _guardedState.spindleToLeadScrewRatio = spindleToLeadScrewRatio;
-  critical_section_exit(&_cs);
+  _spindleToLeadScrewRatio(spindleToLeadScrewRatio, true);
 }
 
-float Leadscrew::threadMetric() {
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::threadMetric() {
   // Back-calculate the pitch based on the lead screw to spindle ratio,
   // the lead screw reduction factor,
   // and the ratio of steps per revolution of the encoder to the
@@ -144,4 +936,350 @@ float Leadscrew::threadMetric() {
   return 25.4 / tpi;
 }
 
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::feedPerMinute(float inchesPerMinute) {
+  const float feedRate = std::clamp(inchesPerMinute * _stepsPerInch() / 60, -_setup.rapidSpeed, _setup.rapidSpeed);
+
+  _state.feedRate = feedRate;
+
+  critical_section_enter_blocking(&_cs);
+  _guardedState.feedRate = feedRate;
+  critical_section_exit(&_cs);
+
+  _updateSampling();
+
+  flightRecorder.record(EventFeedRate, feedRate);
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::feedPerMinute() {
+  return _state.feedRate * 60 / _stepsPerInch();
+}
+
+/**
+ * @brief Poll the encoder at the full rate while the spindle is
+ *        followed, engaged or through a threading cycle, whose phase
+ *        is tracked throughout. Otherwise the poll interval adapts to
+ *        the spindle speed. Called after every change to any of them,
+ *        and before engaging, so that the first samples the loop sees
+ *        are already at full rate.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::_updateSampling(bool engaging) {
+  critical_section_enter_blocking(&_cs);
+  const bool engaged = engaging || _guardedState.engaged;
+  _encoder.fastSampling(_guardedState.cycle || (engaged && _guardedState.feedRate == 0));
+  critical_section_exit(&_cs);
+}
+
+/**
+ * @brief Follow the spindle at the given ratio, ending any feed
+ *        that ignores it.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::_spindleToLeadScrewRatio(float ratio, bool threading) {
+  _state.spindleToLeadScrewRatio = ratio;
+  _state.feedRate = 0;
+  _threading = threading;
+
+  critical_section_enter_blocking(&_cs);
+  _guardedState.spindleToLeadScrewRatio = ratio;
+  _guardedState.feedRate = 0;
+  critical_section_exit(&_cs);
+
+  _updateSampling();
+
+  flightRecorder.record(EventRatio, ratio);
+
+  // An interval given as a length depends on the feed
+
+  _updateChipBreaking();
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::chipBreaking(bool enable) {
+  _chipBreaking = enable;
+
+  _updateChipBreaking();
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::chipBreakRevolutions(float revolutions, float dwellRevolutions, float retractInches) {
+  _setup.chipBreakRevolutions = revolutions;
+  _setup.chipBreakDwell = dwellRevolutions;
+  _setup.chipBreakRetract = retractInches;
+  _chipBreakLength = 0;
+
+  _updateChipBreaking();
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::chipBreakLength(float inches, float dwellRevolutions, float retractInches) {
+  _setup.chipBreakDwell = dwellRevolutions;
+  _setup.chipBreakRetract = retractInches;
+  _chipBreakLength = inches;
+
+  _updateChipBreaking();
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::chipBreakRevolutions() {
+  if (_chipBreakLength == 0) {
+    return _setup.chipBreakRevolutions;
+  }
+
+  const float ipr = fabsf(powerFeedIPR());
+
+  return ipr == 0 ? 0 : _chipBreakLength / ipr;
+}
+
+/**
+ * @brief Convert the chip breaking settings into encoder counts
+ *        and steps for the loop. Only feeds per revolution are
+ *        interrupted; anything else turns chip breaking off.
+ */
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::_updateChipBreaking() {
+  const float countsPerRevolution = _encoder.stepsPerRevolution();
+
+  int32_t feed = 0;
+  int32_t dwell = 0;
+  float retract = 0;
+
+  if (_chipBreaking && !_threading) {
+    feed = std::max<int32_t>(lroundf(chipBreakRevolutions() * countsPerRevolution), 0);
+    dwell = std::max<int32_t>(lroundf(_setup.chipBreakDwell * countsPerRevolution), 0);
+    retract = fabsf(_setup.chipBreakRetract) * _stepsPerInch();
+  }
+
+  _state.chipBreakFeed = feed;
+  _state.chipBreakDwell = dwell;
+  _state.chipBreakRetract = retract;
+
+  critical_section_enter_blocking(&_cs);
+  _guardedState.chipBreakFeed = feed;
+  _guardedState.chipBreakDwell = dwell;
+  _guardedState.chipBreakRetract = retract;
+  critical_section_exit(&_cs);
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::jog(bool enable) {
+  if (enable && !_setup.handwheel) {
+    return;
+  }
+
+  const float stepsPerCount = enable ?
+    _jogMultiplier * _setup.handwheelResolution * _stepsPerInch() / _setup.handwheelCountsPerDetent : 0;
+
+  critical_section_enter_blocking(&_cs);
+  const bool refused = enable && (_faults || _guardedState.engaged || _guardedState.cycle);
+
+  if (!refused) {
+    _guardedState.jogStepsPerCount = stepsPerCount;
+  }
+  critical_section_exit(&_cs);
+
+  if (refused) {
+    return;
+  }
+
+  flightRecorder.record(EventJog, int32_t(enable ? _jogMultiplier : 0));
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::jogMultiplier(uint32_t multiplier) {
+  _jogMultiplier = std::max<uint32_t>(multiplier, 1);
+
+  if (jogging()) {
+    jog(true);
+  }
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::starts(uint8_t starts) {
+  _starts = std::max<uint8_t>(starts, 1);
+
+  start(0);
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+uint8_t Leadscrew<EncoderT, StepperT, FeedbackT>::starts() {
+  return _starts;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::start(uint8_t start) {
+  const float countsPerRevolution = _encoder.stepsPerRevolution();
+  const float phase = float(start % _starts) * countsPerRevolution / _starts;
+
+  // Shift by the shortest equivalent angle, so that the
+  // carriage never moves by more than half a lead
+
+  float shift = phase - _phase;
+
+  if (shift > countsPerRevolution / 2) {
+    shift -= countsPerRevolution;
+  } else if (shift <= -countsPerRevolution / 2) {
+    shift += countsPerRevolution;
+  }
+
+  _start = start % _starts;
+  _phase = phase;
+
+  critical_section_enter_blocking(&_cs);
+  _pendingPhaseShift += shift;
+  critical_section_exit(&_cs);
+
+  flightRecorder.record(EventStart, int32_t(_start));
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+uint8_t Leadscrew<EncoderT, StepperT, FeedbackT>::start() {
+  return _start;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::startAngle() {
+  return _phase * 360.0 / _encoder.stepsPerRevolution();
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::_stepsPerInch() {
+  return _setup.leadscrewPitch * _setup.leadScrewReductionFactor / 100.0 * _stepper.stepsPerRevolution();
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+bool Leadscrew<EncoderT, StepperT, FeedbackT>::cycle(bool enable) {
+  if (enable == cycle()) {
+    return true;
+  }
+
+  if (enable && jogging()) {
+    return false;
+  }
+
+  if (enable) {
+    // The loop owns the cycle state once the cycle is enabled
+
+    _cycleState = CycleReady;
+    _cyclePasses = 0;
+  }
+
+  critical_section_enter_blocking(&_cs);
+  _guardedState.cycle = enable;
+  _guardedState.engaged = false;
+  _cycleConfirmed = false;
+  critical_section_exit(&_cs);
+
+  _updateSampling();
+
+  flightRecorder.record(EventCycle, int32_t(enable));
+
+  return true;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+LeadscrewCycle Leadscrew<EncoderT, StepperT, FeedbackT>::cycleCheckpoint() {
+  LeadscrewCycle result;
+
+  critical_section_enter_blocking(&_cs);
+  result = _guardedCycle;
+  critical_section_exit(&_cs);
+
+  result.starts = _starts;
+  result.start = _start;
+  result.length = _state.cycleLength;
+  result.ratio = _state.spindleToLeadScrewRatio;
+
+  return result;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+bool Leadscrew<EncoderT, StepperT, FeedbackT>::resumeCycle(const LeadscrewCycle &cycle) {
+  if (cycle.state == CycleOff || cycle.starts == 0 || this->cycle() || engaged() || jogging()) {
+    return false;
+  }
+
+  // The reference only holds for the pitch it was taken at
+
+  if (fabsf(cycle.ratio - _state.spindleToLeadScrewRatio) > fabsf(cycle.ratio) * 1e-4f) {
+    return false;
+  }
+
+  // The start is set without shifting the carriage, which is
+  // already where the saved cycle left it
+
+  _starts = cycle.starts;
+  _start = cycle.start % _starts;
+  _phase = float(_start) * _encoder.stepsPerRevolution() / _starts;
+
+  _state.cycleLength = cycle.length;
+
+  critical_section_enter_blocking(&_cs);
+  _guardedState.cycleLength = cycle.length;
+  _guardedState.cycle = true;
+  _guardedState.engaged = false;
+  _pendingPhaseShift = 0;
+  _cycleConfirmed = false;
+  _resumedCycle = cycle;
+  _cycleResumed = true;
+  critical_section_exit(&_cs);
+
+  _updateSampling();
+
+  flightRecorder.record(EventCycle, 1);
+
+  return true;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+bool Leadscrew<EncoderT, StepperT, FeedbackT>::cycle() {
+  bool result;
+
+  critical_section_enter_blocking(&_cs);
+  result = _guardedState.cycle;
+  critical_section_exit(&_cs);
+
+  return result;
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+void Leadscrew<EncoderT, StepperT, FeedbackT>::cycleLength(float inches) {
+  const float length = inches * _stepsPerInch();
+
+  _state.cycleLength = length;
+
+  critical_section_enter_blocking(&_cs);
+  _guardedState.cycleLength = length;
+  critical_section_exit(&_cs);
+}
+
+template <typename EncoderT, typename StepperT, typename FeedbackT>
+float Leadscrew<EncoderT, StepperT, FeedbackT>::cycleLength() {
+  return _state.cycleLength / _stepsPerInch();
+}
+
+
+// GCC ignores section attributes on template instantiations, so
+// each machine's loop is specialized in order to place it in RAM.
+// The rest of the hot path is forced inline into it.
+
+template <>
+__not_in_flash("HardwareLeadscrew::loop") void Leadscrew<Encoder, Stepper, QuadratureEncoder>::loop() {
+  while(1) {
+    _iterate();
+  }
+}
+
+template <>
+__not_in_flash("SimulatedLeadscrew::loop") void Leadscrew<EncoderSimulator, Stepper, QuadratureEncoderSimulator>::loop() {
+  while(1) {
+    _iterate();
+  }
+}
+
+// The machines in Machine.hpp
 
+template class Leadscrew<Encoder, Stepper, QuadratureEncoder>;
+template class Leadscrew<EncoderSimulator, Stepper, QuadratureEncoderSimulator>;
@@ -0,0 +1,113 @@
+#include <MemoryMonitor.hpp>
+#include <malloc.h>
+#include "hardware/structs/xip_ctrl.h"
+
+
+// Stack limits of each core, from the linker script
+
+extern uint32_t __StackBottom;
+extern uint32_t __StackTop;
+extern uint32_t __StackOneBottom;
+extern uint32_t __StackOneTop;
+
+
+#ifdef ZERO_HEAP
+extern "C" void *__real__malloc_r(struct _reent *reent, size_t size);
+
+// Every allocation in newlib, including those made by calloc,
+// realloc and the library itself, goes through _malloc_r
+
+extern "C" void *__wrap__malloc_r(struct _reent *reent, size_t size) {
+  memoryMonitor._allocation(size);
+  return __real__malloc_r(reent, size);
+}
+#endif // ZERO_HEAP
+
+
+void MemoryMonitor::paintStack() {
+  uint32_t *bottom = get_core_num() == 0 ? &__StackBottom : &__StackOneBottom;
+
+  // Leave room below the current frame for this function
+  // and for any interrupt that fires while painting
+
+  uint32_t *end = (uint32_t *)__builtin_frame_address(0) - 64;
+
+  for (uint32_t *word = bottom; word < end; word++) {
+    *word = MEMORY_MONITOR_PAINT;
+  }
+}
+
+void MemoryMonitor::ready() {
+#ifdef ZERO_HEAP
+  // Newlib sets up its buffers for converting floats the
+  // first time one is formatted, so get that out of the way
+
+  char buffer[16];
+  snprintf(buffer, sizeof(buffer), "%f", 1.5);
+#endif // ZERO_HEAP
+
+  _ready[get_core_num()] = true;
+}
+
+uint32_t MemoryMonitor::stackSize(uint core) {
+  if (core == 0) {
+    return (uint8_t *)&__StackTop - (uint8_t *)&__StackBottom;
+  }
+
+  return (uint8_t *)&__StackOneTop - (uint8_t *)&__StackOneBottom;
+}
+
+uint32_t MemoryMonitor::stackUsed(uint core) {
+  uint32_t *bottom = core == 0 ? &__StackBottom : &__StackOneBottom;
+  uint32_t *top = core == 0 ? &__StackTop : &__StackOneTop;
+  uint32_t *word = bottom;
+
+  while (word < top && *word == MEMORY_MONITOR_PAINT) {
+    word++;
+  }
+
+  return (uint8_t *)top - (uint8_t *)word;
+}
+
+/**
+ * @brief The most the heap has ever held, since newlib never
+ *        hands memory it obtained back to the system
+ */
+uint32_t MemoryMonitor::heapPeak() {
+  return mallinfo().arena;
+}
+
+uint32_t MemoryMonitor::heapUsed() {
+  return mallinfo().uordblks;
+}
+
+uint32_t MemoryMonitor::xipAccesses() {
+  return xip_ctrl_hw->ctr_acc;
+}
+
+uint32_t MemoryMonitor::xipHits() {
+  return xip_ctrl_hw->ctr_hit;
+}
+
+void MemoryMonitor::clearXipCounters() {
+  xip_ctrl_hw->ctr_acc = 0;
+  xip_ctrl_hw->ctr_hit = 0;
+}
+
+void MemoryMonitor::_allocation(size_t size) {
+  const uint core = get_core_num();
+
+  if (!armed() || _permits[core] > 0) {
+    return;
+  }
+
+  _allocations[core] = _allocations[core] + 1;
+
+  if (size > _largestAllocation) {
+    _largestAllocation = size;
+  }
+
+#ifndef ZERO_HEAP_DIAGNOSTIC
+  panic("Allocated %u bytes on core %u after setup", (unsigned)size, core);
+#endif // ZERO_HEAP_DIAGNOSTIC
+}
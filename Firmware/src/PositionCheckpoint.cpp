@@ -0,0 +1,227 @@
+#include <PositionCheckpoint.hpp>
+#include <MemoryMonitor.hpp>
+#include <LittleFS.h>
+
+
+// Left alone by the runtime at boot, so that it keeps what was
+// written to it before a reset
+
+static uint32_t __uninitialized_ram(_checkpointScratch)[POSITION_CHECKPOINT_WORDS];
+
+
+void PositionCheckpoint::begin() {
+  uint32_t words[POSITION_CHECKPOINT_WORDS];
+  PositionCheckpointRecord record;
+
+  memcpy(words, _checkpointScratch, sizeof(words));
+
+  if (_decode(words, record)) {
+    _source = CheckpointScratch;
+  } else if (_readFile(words) && _decode(words, record)) {
+    _source = CheckpointFlash;
+  }
+
+  if (_source != CheckpointNone) {
+    _record = record;
+    memcpy(_saved, words, sizeof(_saved));
+  }
+
+  _restTime = get_absolute_time();
+  _loaded = true;
+}
+
+void PositionCheckpoint::resumeCycle() {
+  if (_source == CheckpointNone || _record.cycle.state == CycleOff) {
+    return;
+  }
+
+  if (_record.mode != TPI && _record.mode != Metric) {
+    return;
+  }
+
+  // The display sets the leadscrew's pitch, which has to be
+  // the one the cycle's reference was taken at. Its timer is
+  // held off so that the buttons cannot change it meanwhile.
+
+  Display &display = _setup.display;
+
+  display.hold(true);
+
+  if (_record.mode == TPI) {
+    display.threadTPI(_record.pitch);
+  } else {
+    display.threadMetric(_record.pitch);
+  }
+
+  _cycleResumed = _setup.leadscrew.resumeCycle(_record.cycle);
+  display.hold(false);
+}
+
+void PositionCheckpoint::loop() {
+  if (!_resumed || absolute_time_diff_us(_nextUpdate, get_absolute_time()) < 0) {
+    return;
+  }
+
+  _nextUpdate = make_timeout_time_ms(_setup.interval);
+
+  uint32_t words[POSITION_CHECKPOINT_WORDS];
+
+  _encode(_current(), words);
+  _writeScratch(words);
+
+  if (memcmp(words, _last, sizeof(words))) {
+    memcpy(_last, words, sizeof(_last));
+    _restTime = get_absolute_time();
+    return;
+  }
+
+  // Writing to flash stalls the other core, so the record is
+  // only saved once nothing has moved for a while, and only
+  // when it differs from the saved one
+
+  if (!_setup.leadscrew.atRest(_setup.saveDelay)) {
+    return;
+  }
+
+  if (absolute_time_diff_us(_restTime, get_absolute_time()) < int64_t(_setup.saveDelay) * 1000) {
+    return;
+  }
+
+  if (!memcmp(words, _saved, sizeof(words))) {
+    return;
+  }
+
+  if (_writeFile(words)) {
+    memcpy(_saved, words, sizeof(_saved));
+    _saves++;
+  }
+}
+
+PositionCheckpointRecord PositionCheckpoint::_current() {
+  MachineLeadscrew &leadscrew = _setup.leadscrew;
+  PositionCheckpointRecord record = {};
+
+  record.spindlePosition = _setup.encoder.cumulativePosition();
+  record.carriagePosition = leadscrew.stepper().position;
+  record.cycle = leadscrew.cycleCheckpoint();
+
+  // The rest only matters to a cycle, and is left out otherwise
+  // so that changing modes does not wear the flash
+
+  if (record.cycle.state == CycleOff) {
+    record.cycle = {};
+    return record;
+  }
+
+  const DisplayMode mode = _setup.display.mode();
+
+  record.mode = mode;
+  record.pitch = mode == Metric ? leadscrew.threadMetric() : leadscrew.threadTPI();
+
+  return record;
+}
+
+/**
+ * @brief A check word over the record, so that memory left random by
+ *        a power cut, or half written by a reset, is not trusted
+ */
+uint32_t PositionCheckpoint::_check(const uint32_t *words) {
+  uint32_t check = POSITION_CHECKPOINT_MAGIC;
+
+  for (size_t i = 0; i < POSITION_CHECKPOINT_WORDS - 1; i++) {
+    check = (check << 11 | check >> 21) ^ words[i];
+  }
+
+  return check;
+}
+
+void PositionCheckpoint::_encode(const PositionCheckpointRecord &record, uint32_t *words) {
+  const LeadscrewCycle &cycle = record.cycle;
+
+  words[0] = uint32_t(uint64_t(record.spindlePosition));
+  words[1] = uint32_t(uint64_t(record.spindlePosition) >> 32);
+  memcpy(&words[2], &record.carriagePosition, sizeof(float));
+  words[3] = uint32_t(cycle.state) | uint32_t(record.mode) << 8 | uint32_t(uint8_t(cycle.direction)) << 16 | uint32_t(cycle.starts) << 24;
+  words[4] = uint32_t(cycle.start) | cycle.passes << 8;
+  words[5] = uint32_t(uint64_t(cycle.reference));
+  words[6] = uint32_t(uint64_t(cycle.reference) >> 32);
+  memcpy(&words[7], &cycle.startPosition, sizeof(float));
+  memcpy(&words[8], &cycle.length, sizeof(float));
+  memcpy(&words[9], &cycle.ratio, sizeof(float));
+  memcpy(&words[10], &record.pitch, sizeof(float));
+  words[11] = _check(words);
+}
+
+bool PositionCheckpoint::_decode(const uint32_t *words, PositionCheckpointRecord &record) {
+  if (_check(words) != words[POSITION_CHECKPOINT_WORDS - 1]) {
+    return false;
+  }
+
+  LeadscrewCycle &cycle = record.cycle;
+
+  record.spindlePosition = int64_t(uint64_t(words[1]) << 32 | words[0]);
+  memcpy(&record.carriagePosition, &words[2], sizeof(float));
+  cycle.state = ThreadingCycleState(words[3] & 0xFF);
+  record.mode = uint8_t(words[3] >> 8);
+  cycle.direction = int8_t(words[3] >> 16);
+  cycle.starts = uint8_t(words[3] >> 24);
+  cycle.start = uint8_t(words[4]);
+  cycle.passes = words[4] >> 8;
+  cycle.reference = int64_t(uint64_t(words[6]) << 32 | words[5]);
+  memcpy(&cycle.startPosition, &words[7], sizeof(float));
+  memcpy(&cycle.length, &words[8], sizeof(float));
+  memcpy(&cycle.ratio, &words[9], sizeof(float));
+  memcpy(&record.pitch, &words[10], sizeof(float));
+
+  return true;
+}
+
+void PositionCheckpoint::_writeScratch(const uint32_t *words) {
+  volatile uint32_t *scratch = _checkpointScratch;
+  const size_t last = POSITION_CHECKPOINT_WORDS - 1;
+
+  // The check word is spoiled first, so that a reset part way
+  // through leaves the record invalid rather than mixed
+
+  scratch[last] = ~scratch[last];
+
+  for (size_t i = 0; i < last; i++) {
+    scratch[i] = words[i];
+  }
+
+  scratch[last] = words[last];
+}
+
+bool PositionCheckpoint::_readFile(uint32_t *words) {
+  AllocationPermit permit; // LittleFS allocates its file handles
+
+  File file = LittleFS.open(_setup.path, "r");
+
+  if (!file) {
+    return false;
+  }
+
+  const size_t size = POSITION_CHECKPOINT_WORDS * sizeof(uint32_t);
+  const bool complete = file.read((uint8_t *)words, size) == size;
+
+  file.close();
+
+  return complete;
+}
+
+bool PositionCheckpoint::_writeFile(const uint32_t *words) {
+  AllocationPermit permit; // LittleFS allocates its file handles
+
+  File file = LittleFS.open(_setup.path, "w");
+
+  if (!file) {
+    return false;
+  }
+
+  const size_t size = POSITION_CHECKPOINT_WORDS * sizeof(uint32_t);
+  const bool complete = file.write((const uint8_t *)words, size) == size;
+
+  file.close();
+
+  return complete;
+}
@@ -0,0 +1,114 @@
+#include <QuadratureEncoder.hpp>
+#include <quadrature_encoder.pio.h>
+#include "hardware/irq.h"
+
+
+void QuadratureEncoder::begin() {
+  // The program uses computed jumps and must live at address 0,
+  // so it is loaded once per PIO block and shared by all encoders
+
+  static bool programLoaded[2] = { false, false };
+  const uint index = _setup.pio == pio0 ? 0 : 1;
+
+  if (!programLoaded[index]) {
+    pio_add_program(_setup.pio, &quadrature_encoder_program);
+    programLoaded[index] = true;
+  }
+
+  _sm = pio_claim_unused_sm(_setup.pio, true);
+  quadrature_encoder_program_init(_setup.pio, _sm, _setup.pinA, _setup.maxStepRate);
+}
+
+void QuadratureEncoder::retime() {
+  pio_sm_set_clkdiv(_setup.pio, _sm, quadrature_encoder_clkdiv(_setup.maxStepRate));
+}
+
+int32_t __not_in_flash_func(QuadratureEncoder::count)() {
+  // The state machine pushes the count once per pass of its loop,
+  // which with a low maximum step rate is slowed right down, so
+  // the last value in the FIFO is taken if there is one, and the
+  // one before kept otherwise. Waiting would stall the caller.
+
+  for (uint n = pio_sm_get_rx_fifo_level(_setup.pio, _sm); n > 0; n--) {
+    _count = pio_sm_get(_setup.pio, _sm);
+  }
+
+  return int32_t(_count);
+}
+
+
+static QuadratureEncoderSimulator *_simulatorInstance = nullptr;
+
+void __not_in_flash_func(_quadratureEncoderSimulatorIRQ)() {
+  const pin_size_t pin = _simulatorInstance->_simulation.pulsePin;
+
+  if (gpio_get_irq_event_mask(pin) & GPIO_IRQ_EDGE_RISE) {
+    gpio_acknowledge_irq(pin, GPIO_IRQ_EDGE_RISE);
+    _simulatorInstance->_pulse();
+  }
+}
+
+void QuadratureEncoderSimulator::begin() {
+  _simulatorInstance = this;
+
+  if (_simulation.maxStepRate > 0) {
+    _minPulseInterval = 1000000 / _simulation.maxStepRate;
+  }
+
+  gpio_add_raw_irq_handler(_simulation.pulsePin, _quadratureEncoderSimulatorIRQ);
+  gpio_set_irq_enabled(_simulation.pulsePin, GPIO_IRQ_EDGE_RISE, true);
+  irq_set_enabled(IO_IRQ_BANK0, true);
+}
+
+int32_t __not_in_flash_func(QuadratureEncoderSimulator::count)() {
+  int32_t steps = _steps;
+
+  if (_simulation.lag > 0) {
+    const uint32_t now = time_us_32();
+
+    if ((now - _historyTime) * QUADRATURE_ENCODER_SIMULATOR_HISTORY >= _simulation.lag) {
+      _historyTime = now;
+      _history[_historyIndex] = steps;
+      _historyIndex = (_historyIndex + 1) % QUADRATURE_ENCODER_SIMULATOR_HISTORY;
+    }
+
+    // The next one to be replaced is the oldest
+
+    steps = _history[_historyIndex];
+  }
+
+  return int32_t(roundf(steps * _simulation.countsPerStep));
+}
+
+void QuadratureEncoderSimulator::missSteps(uint32_t steps) {
+  _missRemaining = _missRemaining + steps;
+}
+
+void __not_in_flash_func(QuadratureEncoderSimulator::_pulse)() {
+  const uint32_t now = time_us_32();
+  const uint32_t interval = now - _lastPulseTime;
+
+  _lastPulseTime = now;
+
+  if (_missRemaining > 0) {
+    _missRemaining = _missRemaining - 1;
+    return;
+  }
+
+  if (interval < _minPulseInterval) {
+    return;
+  }
+
+  _motor += gpio_get(_simulation.directionPin) ? 1 : -1;
+
+  // The carriage only moves when the motor pushes it from
+  // either end of the lash
+
+  const int32_t backlash = _simulation.backlash;
+
+  if (_motor > _steps) {
+    _steps = _motor;
+  } else if (_motor < _steps - backlash) {
+    _steps = _motor + backlash;
+  }
+}
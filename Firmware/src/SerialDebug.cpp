@@ -1,83 +1,641 @@
 #include <SerialDebug.hpp>
+#include <strings.h>
 
 
-bool _serialDebugTimerCallback(repeating_timer_t *rt) {
-  SerialDebug *serialDebug = (SerialDebug *)rt->user_data;
-  serialDebug->_loop();
-  return true;
+// The simulators take a few extra commands and a parameter of
+// their own. Which overload is used follows from the machine.
+
+static bool _simulatorCommand(Encoder &, QuadratureEncoder &, const char *, const char *, float) {
+  return false;
+}
+
+static bool _simulatorCommand(EncoderSimulator &encoder, QuadratureEncoderSimulator &feedback, const char *command, const char *argument, float value) {
+  if (!strcmp(command, "speed") && argument) {
+    encoder.speed(fabsf(value));
+    encoder.direction(value < 0 ? Backwards : Forwards);
+    return true;
+  }
+
+  if (!strcmp(command, "miss") && value > 0) {
+    feedback.missSteps(uint32_t(value));
+    return true;
+  }
+
+  return false;
+}
+
+static const char *_simulatorDirection(Encoder &) {
+  return nullptr;
 }
 
+static const char *_simulatorDirection(EncoderSimulator &encoder) {
+  return encoder.direction() == Forwards ? "FWD" : "CCW";
+}
+
+static uint32_t *_simulatorBacklash(QuadratureEncoder &) {
+  return nullptr;
+}
+
+static uint32_t *_simulatorBacklash(QuadratureEncoderSimulator &feedback) {
+  return &feedback.simulation().backlash;
+}
+
+
 void SerialDebug::begin() {
-  add_repeating_timer_ms(_setup.updateInterval, _serialDebugTimerCallback, this, &_timer);
+  // Only fields that are read on every use are listed, since
+  // the rest are applied once when each component starts
+
+  const SerialDebugParameter parameters[] = {
+    { "EncoderUpdateInterval",          ParameterUInt32, &_setup.encoder.setup().updateInterval,               1, 100000 },
+    { "EncoderIdleUpdateInterval",      ParameterUInt32, &_setup.encoder.setup().idleUpdateInterval,           1, 100000 },
+    { "EncoderSlowDownDelay",           ParameterUInt32, &_setup.encoder.setup().slowDownDelay,                0, 10000 },
+    { "EncoderCountsPerSample",         ParameterUInt32, &_setup.encoder.setup().countsPerSample,              1, 1000 },
+    { "LeadScrewInterpolationInterval", ParameterUInt32, &_setup.leadscrew.setup().interpolationMaxInterval,   0, 100000 },
+    { "LeadScrewStepRateWarning",       ParameterFloat,  &_setup.leadscrew.setup().stepRateWarning,            0, 1 },
+    { "StepperBacklash",                ParameterUInt32, &_setup.leadscrew.stepper().setup().backlash,         0, 10000 },
+    { "FeedbackDeadband",               ParameterFloat,  &_setup.leadscrew.setup().feedbackDeadband,           0, 10000 },
+    { "FeedbackMaxCorrection",          ParameterFloat,  &_setup.leadscrew.setup().feedbackMaxCorrection,      0, 10000 },
+    { "FeedbackCorrectionRate",         ParameterFloat,  &_setup.leadscrew.setup().feedbackCorrectionRate,     0, 100000 },
+    { "FeedbackLag",                    ParameterUInt32, &_setup.leadscrew.setup().feedbackLag,                0, 100000 },
+    { "FeedbackTolerance",              ParameterFloat,  &_setup.leadscrew.setup().feedbackTolerance,          0, 100000 },
+    { "DisplayUpdateInterval",          ParameterUInt32, &_setup.display.setup().displayUpdateIntervalMs,      1, 10000 },
+    { "DisplayAutoOffInterval",         ParameterUInt32, &_setup.display.setup().displayAutoOffInterval,       1, 86400 },
+    { "DisplayMessageInterval",         ParameterUInt32, &_setup.display.setup().displayMessageIntervalMs,     0, 10000 },
+    { "FlightRecorderFreezeOnMiss",     ParameterBool,   &_setup.flightRecorder.setup().freezeOnDeadlineMiss,  0, 1 },
+    { "ClockHighSpeedRPM",              ParameterFloat,  &_setup.clockProfiles.setup().highSpeedRPM,          0, 10000 },
+    { "ClockIdleDelay",                 ParameterUInt32, &_setup.clockProfiles.setup().idleDelay,             1, 86400 },
+    { "SerialDebugUpdateInterval",      ParameterUInt32, &_setup.updateInterval,                               10, 60000 },
+  };
+
+  static_assert(sizeof(parameters) / sizeof(parameters[0]) < SERIAL_DEBUG_MAX_PARAMETERS, "Too many parameters");
+
+  _parameterCount = sizeof(parameters) / sizeof(parameters[0]);
+  std::copy(parameters, parameters + _parameterCount, _parameters);
+
+  uint32_t *simulatorBacklash = _simulatorBacklash(_setup.feedback);
+
+  if (simulatorBacklash) {
+    _parameters[_parameterCount++] = { "FeedbackSimulatorBacklash", ParameterUInt32, simulatorBacklash, 0, 10000 };
+  }
 
   Serial.begin(115200);
   Serial.println("Site 3 Electronic Leadscrew Driver");
 }
 
-void SerialDebug::_loop() {
-  Serial.printf("Encoder position: %d | Speed: %f",
-    _setup.encoder.cumulativePosition(),
+void SerialDebug::loop() {
+  // Drain whatever has arrived without waiting for more; the
+  // core's receive buffer holds input between calls
+
+  while (Serial.available() > 0) {
+    const char c = Serial.read();
+
+    if (c == '\r' || c == '\n') {
+      if (_lineLength == 0 && !_lineOverflow) {
+        continue;
+      }
+
+      Serial.println();
+
+      if (_lineOverflow) {
+        Serial.println("error: line too long");
+      } else {
+        // Commands call the same setters as the buttons, whose
+        // timer would otherwise interrupt them half way through
+
+        _line[_lineLength] = 0;
+        _setup.display.hold(true);
+        _execute(_line);
+        _setup.display.hold(false);
+      }
+
+      _lineLength = 0;
+      _lineOverflow = false;
+
+      // Run one command per call, so that the rest of the
+      // main loop is never held up by a burst of input
+
+      break;
+    }
+
+    if (c == '\b' || c == 0x7F) {
+      if (_lineLength > 0) {
+        _lineLength--;
+        Serial.print("\b \b");
+      }
+
+      continue;
+    }
+
+    if (_lineLength < SERIAL_DEBUG_LINE_LENGTH - 1) {
+      _line[_lineLength++] = c;
+      Serial.print(c);
+    } else {
+      _lineOverflow = true;
+    }
+  }
+
+  // The table is saved to flash, which stalls the other core,
+  // so a finished calibration waits for the carriage to be
+  // at rest
+
+  if (_calibrating && !_setup.encoder.calibrating() && _setup.leadscrew.atRest(_setup.saveDelay)) {
+    _finishCalibration();
+  }
+
+  if (_watching && absolute_time_diff_us(get_absolute_time(), _nextStatus) <= 0) {
+    _nextStatus = make_timeout_time_ms(_setup.updateInterval);
+    _status();
+  }
+}
+
+void SerialDebug::_execute(char *line) {
+  char *arguments[SERIAL_DEBUG_MAX_ARGUMENTS + 1] = {};
+  int count = 0;
+  char *context;
+
+  for (char *token = strtok_r(line, " \t", &context); token != nullptr; token = strtok_r(nullptr, " \t", &context)) {
+    if (count > SERIAL_DEBUG_MAX_ARGUMENTS) {
+      Serial.println("error: too many arguments");
+      return;
+    }
+
+    arguments[count++] = token;
+  }
+
+  if (count == 0) {
+    return;
+  }
+
+  const char *command = arguments[0];
+  const char *argument = arguments[1];
+  const float value = argument ? strtof(argument, nullptr) : 0;
+
+  if (!strcmp(command, "help")) {
+    _help();
+  } else if (!strcmp(command, "status")) {
+    _status();
+  } else if (!strcmp(command, "watch")) {
+    _watching = !argument || strcmp(argument, "off");
+    _nextStatus = get_absolute_time();
+  } else if (!strcmp(command, "counters")) {
+    _counters();
+  } else if (!strcmp(command, "memory")) {
+    _memory();
+
+    if (argument && !strcmp(argument, "clear")) {
+      _setup.memoryMonitor.clearXipCounters();
+    }
+  } else if ((!strcmp(command, "tpi") || !strcmp(command, "metric") || !strcmp(command, "ipr")) && value > 0) {
+    // Like the mode buttons, these are locked out for the
+    // duration of a threading cycle
+
+    if (_setup.leadscrew.cycle()) {
+      Serial.println("error: end the threading cycle first");
+      return;
+    }
+
+    if (command[0] == 't') {
+      _setup.display.threadTPI(value);
+    } else if (command[0] == 'm') {
+      _setup.display.threadMetric(value);
+    } else {
+      _setup.display.powerFeedIPR(value);
+    }
+  } else if ((!strcmp(command, "ipm") || !strcmp(command, "mmpm")) && value != 0) {
+    if (command[0] == 'i') {
+      _setup.display.feedIPM(value);
+    } else {
+      _setup.display.feedMMPM(value);
+    }
+  } else if (!strcmp(command, "jog") && argument) {
+    if (!strcmp(argument, "off")) {
+      _setup.leadscrew.jog(false);
+    } else if (value == 1 || value == 10 || value == 100) {
+      _setup.leadscrew.jogMultiplier(uint32_t(value));
+      _setup.leadscrew.jog(true);
+
+      if (!_setup.leadscrew.jogging()) {
+        Serial.println("error: refused, fit a handwheel, disengage and clear faults");
+        return;
+      }
+    } else {
+      Serial.println("error: jog takes 1, 10, 100 or off");
+      return;
+    }
+  } else if ((!strcmp(command, "chip") || !strcmp(command, "chiplen")) && argument) {
+    // The retract is optional; without it the feed only pauses
+
+    const float dwell = arguments[2] ? strtof(arguments[2], nullptr) : 0;
+    const float retract = arguments[3] ? strtof(arguments[3], nullptr) : 0;
+
+    if (!strcmp(argument, "on") || !strcmp(argument, "off")) {
+      _setup.leadscrew.chipBreaking(!strcmp(argument, "on"));
+    } else if (value <= 0 || dwell < 0 || retract < 0) {
+      Serial.println("error: chip takes on, off or a positive interval");
+      return;
+    } else {
+      if (!strcmp(command, "chip")) {
+        _setup.leadscrew.chipBreakRevolutions(value, dwell, retract);
+      } else {
+        _setup.leadscrew.chipBreakLength(value, dwell, retract);
+      }
+
+      _setup.leadscrew.chipBreaking(true);
+    }
+  } else if (!strcmp(command, "calibrate")) {
+    _calibrate(argument);
+  } else if (!strcmp(command, "clock") && argument) {
+    _clock(argument);
+  } else if (!strcmp(command, "engage")) {
+    _setup.leadscrew.engage(true);
+
+    if (!_setup.leadscrew.engaged() && !_setup.leadscrew.cycle()) {
+      Serial.println("error: refused, clear faults or slow the spindle down");
+      return;
+    }
+  } else if (!strcmp(command, "disengage")) {
+    _setup.leadscrew.engage(false);
+  } else if (!strcmp(command, "clear")) {
+    _setup.leadscrew.clearFaults();
+
+    if (_setup.leadscrew.faults() & EmergencyStopFault) {
+      Serial.println("error: emergency stop still active");
+      return;
+    }
+  } else if (!strcmp(command, "starts") && value >= 1 && value <= 255) {
+    _setup.leadscrew.starts(uint8_t(value));
+  } else if (!strcmp(command, "start") && value >= 1 && value <= _setup.leadscrew.starts()) {
+    _setup.leadscrew.start(uint8_t(value) - 1);
+  } else if (!strcmp(command, "cycle") && argument) {
+    const bool enable = strcmp(argument, "off");
+
+    const DisplayMode mode = _setup.display.mode();
+
+    if (enable && (mode == Powerfeed || mode == FeedPerMinute || _setup.leadscrew.engaged())) {
+      Serial.println("error: disengage and select a thread first");
+      return;
+    }
+
+    if (!_setup.leadscrew.cycle(enable)) {
+      Serial.println("error: stop jogging first");
+      return;
+    }
+  } else if (!strcmp(command, "length") && value > 0) {
+    _setup.leadscrew.cycleLength(value);
+  } else if (!strcmp(command, "get")) {
+    _get(argument);
+    return;
+  } else if (!strcmp(command, "set") && argument && arguments[2]) {
+    _set(argument, arguments[2]);
+    return;
+  } else if (!strcmp(command, "freeze")) {
+    _setup.flightRecorder.freeze(FreezeManual);
+  } else if (!strcmp(command, "resume")) {
+    _setup.flightRecorder.resume();
+  } else if (!strcmp(command, "dump") || !strcmp(command, "saved")) {
+    // Printing a recording takes a while and changes nothing,
+    // so the buttons are left working through it
+
+    _setup.display.hold(false);
+
+    if (command[0] == 'd') {
+      _setup.flightRecorder.dump(Serial);
+    } else {
+      _setup.flightRecorder.dumpSaved(Serial);
+    }
+  } else if (_simulatorCommand(_setup.encoder, _setup.feedback, command, argument, value)) {
+    // Handled by the simulator
+  } else {
+    Serial.println("error: unknown command or bad argument, try help");
+    return;
+  }
+
+  Serial.println("ok");
+}
+
+/**
+ * @brief Like Serial.printf, which allocates for long lines,
+ *        but formatted into a fixed buffer on the stack
+ */
+void SerialDebug::_printf(const char *format, ...) {
+  char buffer[SERIAL_DEBUG_PRINT_LENGTH];
+  va_list arguments;
+
+  va_start(arguments, format);
+  const int length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+  va_end(arguments);
+
+  if (length > 0) {
+    Serial.write((const uint8_t *)buffer, std::min<size_t>(length, sizeof(buffer) - 1));
+  }
+}
+
+void SerialDebug::_help() {
+  Serial.println("status | watch [on|off] | counters | memory [clear]");
+  Serial.println("tpi <threads/in> | metric <mm> | ipr <in/rev>");
+  Serial.println("ipm <in/min> | mmpm <mm/min>, negative for reverse");
+  Serial.println("engage | disengage | clear | jog 1|10|100|off");
+  Serial.println("starts <n> | start <k> | cycle on|off | length <in>");
+  Serial.println("chip on|off | chip <revs> | chiplen <in>, then <dwell revs> [retract in]");
+  Serial.println("calibrate [revs|off|clear] | clock auto|idle|nominal|high");
+  Serial.println("get [name] | set <name> <value>");
+  Serial.println("freeze | resume | dump | saved");
+
+  if (Machine::simulated) {
+    Serial.println("speed <rpm, negative for reverse> | miss <steps>");
+  }
+}
+
+void SerialDebug::_status() {
+  _printf("Encoder position: %lld | Speed: %.1f",
+    (long long)_setup.encoder.cumulativePosition(),
     _setup.tachometer.speed()
   );
 
   switch (_setup.display.mode()) {
     case TPI:
-      Serial.printf(" | Mode: TPI | Pitch: %.1f", _setup.leadscrew.threadTPI());
+      _printf(" | Mode: TPI | Pitch: %.2f", _setup.leadscrew.threadTPI());
       break;
 
     case Metric:
-      Serial.printf(" | Mode: Metric | Pitch: %.1f (%.2f TPI)", _setup.leadscrew.threadMetric(), _setup.leadscrew.threadTPI());
+      _printf(" | Mode: Metric | Pitch: %.2f (%.2f TPI)", _setup.leadscrew.threadMetric(), _setup.leadscrew.threadTPI());
       break;
 
     case Powerfeed:
-      Serial.printf(" | Mode: Powerfeed | IPR: %.3f", _setup.leadscrew.powerFeedIPR());
+      _printf(" | Mode: Powerfeed | IPR: %.4f", _setup.leadscrew.powerFeedIPR());
+
+      if (_setup.leadscrew.chipBreaking()) {
+        _printf(" | Chip: every %.2f rev", _setup.leadscrew.chipBreakRevolutions());
+      }
+      break;
+
+    case FeedPerMinute:
+      _printf(" | Mode: Feed | IPM: %.2f (%.1f mm/min)", _setup.leadscrew.feedPerMinute(), _setup.leadscrew.feedPerMinute() * 25.4f);
       break;
   }
 
-#ifdef SIMULATE_ENCODER
-  if (_setup.encoder.direction() == Forwards) {
-    Serial.print(" | Direction: FWD");
-  } else {
-    Serial.print(" | Direction: CCW");
-  } 
-#endif // SIMULATE_ENCODER
+  _printf(" | %s", _setup.leadscrew.engaged() ? "Engaged" : "Disengaged");
+
+  if (_setup.leadscrew.jogging()) {
+    _printf(" | Jog: x%lu", (unsigned long)_setup.leadscrew.jogMultiplier());
+  }
+
+  if (_setup.leadscrew.starts() > 1) {
+    _printf(" | Start: %u/%u (%.1f deg)", _setup.leadscrew.start() + 1, _setup.leadscrew.starts(), _setup.leadscrew.startAngle());
+  }
+
+  if (_setup.leadscrew.cycle()) {
+    _printf(" | Cycle: %u, %lu passes", _setup.leadscrew.cycleState(), (unsigned long)_setup.leadscrew.cyclePasses());
+  }
+
+  if (_setup.leadscrew.faults()) {
+    _printf(" | Fault: %02x", _setup.leadscrew.faults());
+  }
+
+  const char *direction = _simulatorDirection(_setup.encoder);
+
+  if (direction) {
+    _printf(" | Direction: %s", direction);
+  }
+
+  Serial.println();
+}
+
+void SerialDebug::_counters() {
+  _printf("encoder.deadlineMisses %lu\r\n", (unsigned long)_setup.encoder.deadlineMisses());
+  _printf("encoder.updateInterval %lu\r\n", (unsigned long)_setup.encoder.updateInterval());
+  _printf("encoder.samples %lu\r\n", (unsigned long)_setup.encoder.samples());
+  _printf("encoder.frameErrors %lu\r\n", (unsigned long)_setup.encoder.frameErrors());
+  _printf("encoder.implausibleFrames %lu\r\n", (unsigned long)_setup.encoder.implausibleFrames());
+  _printf("encoder.heldSamples %lu\r\n", (unsigned long)_setup.encoder.heldSamples());
+  _printf("encoder.calibrating %u\r\n", _setup.encoder.calibrating());
+  _printf("encoder.correctionPeak %ld\r\n", (long)_setup.encoder.correctionPeak());
+  _printf("leadscrew.watchdog %lu\r\n", (unsigned long)_setup.leadscrew.watchdog());
+  _printf("leadscrew.faults %02x\r\n", _setup.leadscrew.faults());
+  _printf("leadscrew.followingError %.1f\r\n", _setup.leadscrew.followingError());
+  _printf("leadscrew.maxFollowingError %.1f\r\n", _setup.leadscrew.maxFollowingError());
+  _printf("leadscrew.corrections %lu\r\n", (unsigned long)_setup.leadscrew.corrections());
+  _printf("leadscrew.maxStepRate %.0f\r\n", _setup.leadscrew.maxStepRate());
+  _printf("leadscrew.maxSafeRPM %.0f\r\n", _setup.leadscrew.maxSafeRPM());
+  _printf("leadscrew.maxLoopLatency %lu\r\n", (unsigned long)_setup.leadscrew.maxLoopLatency());
+  _printf("leadscrew.chipBreaks %lu\r\n", (unsigned long)_setup.leadscrew.chipBreaks());
+  _printf("stepper.steps %lu\r\n", (unsigned long)_setup.leadscrew.stepper().steps());
+  _printf("stepper.reversals %lu\r\n", (unsigned long)_setup.leadscrew.stepper().reversals());
+  _printf("stepper.takeUpSteps %lu\r\n", (unsigned long)_setup.leadscrew.stepper().takeUpSteps());
+  _printf("stepper.backlashOffset %ld\r\n", (long)_setup.leadscrew.stepper().backlashOffset());
+  _printf("estop.tripped %u\r\n", _setup.emergencyStop.tripped());
+  _printf("estop.trips %lu\r\n", (unsigned long)_setup.emergencyStop.trips());
+  _printf("estop.reactionTime %lu\r\n", (unsigned long)_setup.emergencyStop.reactionTime());
+  _printf("estop.maxReactionTime %lu\r\n", (unsigned long)_setup.emergencyStop.maxReactionTime());
+  _printf("checkpoint.source %u\r\n", _setup.checkpoint.source());
+  _printf("checkpoint.saves %lu\r\n", (unsigned long)_setup.checkpoint.saves());
+  _printf("checkpoint.cycleResumed %u\r\n", _setup.checkpoint.cycleResumed());
+  _printf("clock.profile %u\r\n", _setup.clockProfiles.profile());
+  _printf("clock.forced %u\r\n", _setup.clockProfiles.forced());
+  _printf("clock.khz %lu\r\n", (unsigned long)(clock_get_hz(clk_sys) / 1000));
+  _printf("clock.switches %lu\r\n", (unsigned long)_setup.clockProfiles.switches());
+  _printf("clock.failures %lu\r\n", (unsigned long)_setup.clockProfiles.failures());
+  _printf("flightRecorder.frozen %u\r\n", _setup.flightRecorder.frozen());
+}
+
+void SerialDebug::_memory() {
+  MemoryMonitor &monitor = _setup.memoryMonitor;
+
+  for (uint core = 0; core < 2; core++) {
+    _printf("core%u.stack %lu/%lu\r\n", core, (unsigned long)monitor.stackUsed(core), (unsigned long)monitor.stackSize(core));
+    _printf("core%u.allocations %lu\r\n", core, (unsigned long)monitor.allocations(core));
+  }
+
+  _printf("heap.peak %lu\r\n", (unsigned long)monitor.heapPeak());
+  _printf("heap.used %lu\r\n", (unsigned long)monitor.heapUsed());
+  _printf("heap.largestAllocation %lu\r\n", (unsigned long)monitor.largestAllocation());
+  _printf("heap.armed %u\r\n", monitor.armed());
+
+  const uint32_t accesses = monitor.xipAccesses();
+  const uint32_t misses = accesses - monitor.xipHits();
+
+  _printf("xip.accesses %lu\r\n", (unsigned long)accesses);
+  _printf("xip.misses %lu (%.2f%%)\r\n", (unsigned long)misses, accesses ? 100.0f * misses / accesses : 0.0f);
+}
+
+/**
+ * @brief Start learning the encoder's error, or stop it, or drop the
+ *        table. The spindle must be turning at a steady speed first.
+ */
+void SerialDebug::_calibrate(const char *argument) {
+  if (argument && !strcmp(argument, "off")) {
+    _setup.encoder.calibrate(0);
+    _calibrating = false;
+    return;
+  }
+
+  if (_setup.leadscrew.engaged()) {
+    Serial.println("error: disengage first");
+    return;
+  }
+
+  if (argument && !strcmp(argument, "clear")) {
+    _setup.encoder.clearCorrection();
+    return;
+  }
+
+  // The simulator has no error to learn and never finishes
+
+  if (Machine::simulated || _setup.tachometer.speed() == 0) {
+    Serial.println("error: the spindle must be turning steadily");
+    return;
+  }
+
+  const uint32_t revolutions = argument ? strtoul(argument, nullptr, 10) : _setup.calibrationRevolutions;
+
+  if (revolutions == 0) {
+    Serial.println("error: calibrate takes a number of revolutions");
+    return;
+  }
+
+  _setup.encoder.calibrate(revolutions);
+  _calibrating = true;
+}
+
+void SerialDebug::_finishCalibration() {
+  _calibrating = false;
+
+  if (!_setup.encoder.finishCalibration()) {
+    Serial.println("error: calibration failed, turn the spindle steadily and try again");
+    return;
+  }
 
-  Serial.print("\r");
+  _printf("calibrated, peak correction %ld counts\r\n", (long)_setup.encoder.correctionPeak());
 
-  if (Serial.available()) {
-    char c = Serial.read();
+  if (!_setup.encoder.saveCorrection()) {
+    Serial.println("error: the table is in use but could not be saved");
+  }
+}
+
+/**
+ * @brief Hold a clock profile, or go back to picking one. A held
+ *        profile is applied once nothing is moving.
+ */
+void SerialDebug::_clock(const char *argument) {
+  static const char *const names[ClockProfileCount] = { "idle", "nominal", "high" };
 
-    switch (c) {
-      case 't':
-        _setup.display.mode(TPI);
-        break;
+  if (!strcmp(argument, "auto")) {
+    _setup.clockProfiles.automatic();
+    return;
+  }
+
+  for (uint8_t profile = 0; profile < ClockProfileCount; profile++) {
+    if (!strcmp(argument, names[profile])) {
+      _setup.clockProfiles.force(ClockProfile(profile));
+      return;
+    }
+  }
 
-      case 'm':
-        _setup.display.mode(Metric);
-        break;
+  Serial.println("error: clock takes auto, idle, nominal or high");
+}
 
-      case 'p':
-        _setup.display.mode(Powerfeed);
-        break;
+SerialDebugParameter *SerialDebug::_parameter(const char *name) {
+  for (size_t i = 0; i < _parameterCount; i++) {
+    if (!strcasecmp(_parameters[i].name, name)) {
+      return &_parameters[i];
+    }
+  }
 
-      case 'e':
-        _setup.leadscrew.engage(!_setup.leadscrew.engaged());
-        break;
+  return nullptr;
+}
 
-#ifdef SIMULATE_ENCODER
+/**
+ * @brief Whether a new value keeps the interpolation interval at or
+ *        above the encoder's poll interval, which bound it from
+ *        either side
+ */
+bool SerialDebug::_consistent(const void *field, float value) {
+  uint32_t updateInterval = _setup.encoder.setup().updateInterval;
+  uint32_t interpolationInterval = _setup.leadscrew.setup().interpolationMaxInterval;
 
-      case '.':
-      case '>':
-        _setup.encoder.speed(_setup.encoder.speed() + 10);
-        break;
+  if (field == &_setup.encoder.setup().updateInterval) {
+    updateInterval = uint32_t(value);
+  } else if (field == &_setup.leadscrew.setup().interpolationMaxInterval) {
+    interpolationInterval = uint32_t(value);
+  } else {
+    return true;
+  }
+
+  return interpolationInterval == 0 || interpolationInterval >= updateInterval;
+}
+
+void SerialDebug::_printParameter(const SerialDebugParameter &parameter) {
+  switch (parameter.type) {
+    case ParameterUInt32:
+      _printf("%s %lu\r\n", parameter.name, (unsigned long)*(uint32_t *)parameter.value);
+      break;
+
+    case ParameterFloat:
+      _printf("%s %g\r\n", parameter.name, *(float *)parameter.value);
+      break;
+
+    case ParameterBool:
+      _printf("%s %u\r\n", parameter.name, *(bool *)parameter.value);
+      break;
+  }
+}
 
-      case ',':
-      case '<':
-        _setup.encoder.speed(_setup.encoder.speed() - 10);
-        break;
-        
-#endif // SIMULATE_ENCODER 
+void SerialDebug::_get(const char *name) {
+  if (!name) {
+    for (size_t i = 0; i < _parameterCount; i++) {
+      _printParameter(_parameters[i]);
     }
+
+    return;
+  }
+
+  SerialDebugParameter *parameter = _parameter(name);
+
+  if (!parameter) {
+    Serial.println("error: unknown parameter");
+    return;
   }
+
+  _printParameter(*parameter);
 }
 
+void SerialDebug::_set(const char *name, const char *text) {
+  SerialDebugParameter *parameter = _parameter(name);
+
+  if (!parameter) {
+    Serial.println("error: unknown parameter");
+    return;
+  }
+
+  char *end;
+  const float value = strtof(text, &end);
+
+  if (end == text || *end != 0 || value < parameter->min || value > parameter->max) {
+    _printf("error: expected a number from %g to %g\r\n", parameter->min, parameter->max);
+    return;
+  }
+
+  if (!_consistent(parameter->value, value)) {
+    Serial.println("error: LeadScrewInterpolationInterval must be 0 or at least EncoderUpdateInterval");
+    return;
+  }
+
+  // Each field is a single aligned word, so the motion loop on
+  // the other core sees either the old or the new value
+
+  switch (parameter->type) {
+    case ParameterUInt32:
+      *(uint32_t *)parameter->value = uint32_t(value);
+      break;
+
+    case ParameterFloat:
+      *(float *)parameter->value = value;
+      break;
+
+    case ParameterBool:
+      *(bool *)parameter->value = value != 0;
+      break;
+  }
+
+  _printParameter(*parameter);
+}
@@ -1,4 +1,5 @@
-#include <stepper.hpp>
+#include <Stepper.hpp>
+#include <FlightRecorder.hpp>
 
 
 void Stepper::begin() {
@@ -11,7 +12,7 @@ void Stepper::begin() {
   gpio_put(_setup.directionPin, LOW);
 }
 
-void Stepper::loop() {
+void __not_in_flash_func(Stepper::loop)() {
   // Do nothing if not enabled
 
   if (!_enabled) {
@@ -33,21 +34,65 @@ void Stepper::loop() {
     return;
   }
 
-  if (delta < 0) {
-    gpio_put(_setup.directionPin, HIGH);
-    position++;
-  } else if (delta > 0) {
-    gpio_put(_setup.directionPin, LOW);
-    position--;
+  const int32_t direction = delta < 0 ? 1 : -1;
+
+  if (direction != _direction) {
+    gpio_put(_setup.directionPin, direction > 0 ? HIGH : LOW);
+
+    // On a reversal the lash has to be crossed before the
+    // carriage moves again. If the previous reversal was still
+    // being taken up, only the part already crossed is repeated.
+    // Which side the lash is on is unknown until the first move.
+
+    if (_direction != 0) {
+      _takeUp = _setup.backlash > _takeUp ? _setup.backlash - _takeUp : 0;
+      _reversals = _reversals + 1;
+    }
+
+    _direction = direction;
+  }
+
+  if (_takeUp > 0) {
+    // Take-up steps go out at the full step rate, ahead of
+    // the synchronized steps, which wait for them to finish
+
+    _takeUp--;
+    _backlashOffset = _backlashOffset + direction;
+    _takeUpSteps = _takeUpSteps + 1;
+    _unrecordedTakeUp += direction;
+  } else {
+    position += direction;
+    _unrecordedSteps += direction;
   }
 
   // Step the motor
 
   gpio_put(_setup.pulsePin, HIGH);
   _stepping = true;
+  _steps = _steps + 1;
+
+  // Recording every step would fill the ring in milliseconds
+
+  if (time_us_32() - _recordTime >= FLIGHT_RECORDER_SUMMARY_INTERVAL) {
+    recordSteps();
+  }
+}
+
+void __not_in_flash_func(Stepper::recordSteps)() {
+  _recordTime = time_us_32();
+
+  if (_unrecordedTakeUp != 0) {
+    flightRecorder.record(EventTakeUp, _unrecordedTakeUp);
+    _unrecordedTakeUp = 0;
+  }
+
+  if (_unrecordedSteps != 0) {
+    flightRecorder.record(EventStep, _unrecordedSteps);
+    _unrecordedSteps = 0;
+  }
 }
 
-void Stepper::enabled(bool enabled) {
+void __not_in_flash_func(Stepper::enabled)(bool enabled) {
   if (!_enabled && enabled) {
     position = desiredPosition;
   }
@@ -1,14 +1,26 @@
 #include <encoder.hpp>
+#include <FlightRecorder.hpp>
+#include <MemoryMonitor.hpp>
+#include <LittleFS.h>
+#include <algorithm>
 #include "hardware/spi.h"
 #include "pico/stdlib.h"
 
-bool _encoderTimerCallback(repeating_timer_t *rt) {
+bool __not_in_flash_func(_encoderTimerCallback)(repeating_timer_t *rt) {
   Encoder *encoder = (Encoder *)rt->user_data;
   encoder->_loop();
   return true;
 }
 
 void Encoder::begin() {
+  // The wrap and the correction table work in the frame's bits,
+  // and everything else in steps per revolution, so a thread's
+  // phase would land at the wrong angle if the two disagreed
+
+  if (_setup.stepsPerRevolution != float(1u << _setup.resolutionBits)) {
+    panic("Encoder steps per revolution %g do not match %u resolution bits", double(_setup.stepsPerRevolution), unsigned(_setup.resolutionBits));
+  }
+
   critical_section_init_with_lock_num(&_cs, 1);
 
   spi_init(spi0, _setup.clockSpeed);
@@ -17,75 +29,466 @@ void Encoder::begin() {
   gpio_set_function(_setup.clk, GPIO_FUNC_SPI);
   gpio_set_function(_setup.miso, GPIO_FUNC_SPI);
 
+  // Frames are read in whole bytes, with the data line
+  // expected to be low for the bits clocked after them
+
+  _frameBytes = (_setup.frameBits + _setup.statusBits + 7) / 8;
+  _positionBits = _setup.multiTurn ? _setup.frameBits : _setup.resolutionBits;
+  _correctionShift = std::max(_setup.resolutionBits - ENCODER_CORRECTION_BITS, 0);
+  _maxCountsPerMicrosecond = uint32_t(ceilf(_setup.maxSpeed / 60 * _setup.stepsPerRevolution / 1000000 * 256));
+
   _readPosition(); // Ensure that we have a valid position in _lastPosition
                    // before we start the main loop
 
-  add_repeating_timer_us(_setup.updateInterval, _encoderTimerCallback, this, &_timer);
+  // The cumulative position starts from the absolute reading, so
+  // that it always matches the encoder's own position in the bits
+  // that it decodes. That is what lets resume() find its way back.
+
+  _lastCorrection = _correction[_correctionBin(_position)];
+  _cumulativePosition = _wrap(_position) - _lastCorrection;
+
+  _interval = _setup.updateInterval;
+  add_repeating_timer_us(_interval, _encoderTimerCallback, this, &_timer);
+}
+
+void Encoder::resume(int64_t position) {
+  critical_section_enter_blocking(&_cs);
+  _cumulativePosition = position + _wrap(int32_t(_cumulativePosition - position));
+  critical_section_exit(&_cs);
 }
 
-void inline Encoder::_readPosition() {
+void Encoder::retime() {
+  spi_set_baudrate(spi0, _setup.clockSpeed);
+}
+
+/**
+ * @brief The timer's alarm fires on the core that set up the
+ *        default pool, which is the one the clocks are changed
+ *        from, so no sample is part way through once it is cancelled
+ */
+void Encoder::pause(bool pause) {
+  if (pause) {
+    cancel_repeating_timer(&_timer);
+  } else {
+    add_repeating_timer_us(_interval, _encoderTimerCallback, this, &_timer);
+  }
+}
+
+/**
+ * @brief Read a frame, reading again after a bad one. Once the
+ *        retries run out the previous position is held, so that a
+ *        corrupted frame never moves the leadscrew.
+ */
+void inline __not_in_flash_func(Encoder::_readPosition)() {
   _lastPosition = _position;
   _lastPositionReadTime = _positionReadTime;
 
-  spi_read_blocking(spi0, 0, _buf, 3);
+  for (uint32_t attempt = 0; ; attempt++) {
+    spi_read_blocking(spi0, 0, _buf, _frameBytes);
+
+    const absolute_time_t now = get_absolute_time();
+    uint32_t word = 0;
+
+    for (uint8_t i = 0; i < _frameBytes; i++) {
+      word = word << 8 | _buf[i];
+    }
+
+    uint32_t position;
+
+    if (!_decodeFrame(word, position)) {
+      _frameErrors = _frameErrors + 1;
+      flightRecorder.record(EventEncoderFrame, int32_t(word));
+    } else if (!_plausible(position, now)) {
+      _implausibleFrames = _implausibleFrames + 1;
+      flightRecorder.record(EventEncoderFrame, int32_t(word));
+    } else {
+      _position = position;
+      _positionValid = true;
+      _validReadTime = now;
+      _consecutiveHolds = 0;
+      break;
+    }
+
+    if (attempt >= _setup.maxRetries) {
+      _heldSamples = _heldSamples + 1;
+      _consecutiveHolds = _consecutiveHolds + 1;
+      break;
+    }
+
+    busy_wait_us_32(_setup.retryDelay);
+  }
 
-  uint32_t data = _grayToBinary(_buf[0] << 16 | _buf[1] << 8 | _buf[2]);
-  _position = data & 0xFFF; // We only case about the single-turn position
   _positionReadTime = get_absolute_time();
 }
 
-void Encoder::_loop() {
+/**
+ * @brief Check a frame and extract the position from it, with the
+ *        multi-turn bits when they are decoded
+ *
+ * @return Whether the frame is good; the position is only written
+ *         when it is
+ */
+bool __not_in_flash_func(Encoder::_decodeFrame)(uint32_t word, uint32_t &position) {
+  const uint32_t padding = _frameBytes * 8 - _setup.frameBits - _setup.statusBits;
+
+  // The data line is low once the frame is over, so set bits
+  // after it point to a glitch or to an open line
+
+  if (word & ((1u << padding) - 1)) {
+    return false;
+  }
+
+  const uint32_t frame = word >> padding;
+
+  if (_setup.parity && _parity(frame)) {
+    return false;
+  }
+
+  if (frame & _setup.statusErrorMask & ((1u << _setup.statusBits) - 1)) {
+    return false;
+  }
+
+  position = _grayToBinary(frame >> _setup.statusBits) & (0xFFFFFFFFu >> (32 - _positionBits));
+  return true;
+}
+
+/**
+ * @brief Whether the spindle could have turned from the last good
+ *        position to this one in the time since it was read
+ */
+bool __not_in_flash_func(Encoder::_plausible)(uint32_t position, absolute_time_t now) {
+  if (!_positionValid || _maxCountsPerMicrosecond == 0) {
+    return true;
+  }
+
+  const int64_t elapsed = absolute_time_diff_us(_validReadTime, now);
+
+  if (elapsed >= ENCODER_PLAUSIBILITY_MAX_TIME) {
+    return true;
+  }
+
+  // Rounded up, as a sample interval holds a fraction of a count at speed
+
+  const uint32_t limit = ((uint32_t(elapsed) * _maxCountsPerMicrosecond + 255) >> 8) + ENCODER_PLAUSIBILITY_SLACK;
+
+  return uint32_t(abs(_wrap(position - _position))) <= limit;
+}
+
+/**
+ * @brief Take the shortest way round between two positions, since
+ *        the position wraps once its bits run out. Sign extending
+ *        from the top position bit does that in two shifts.
+ */
+int32_t __not_in_flash_func(Encoder::_wrap)(int32_t diff) {
+  const uint8_t shift = 32 - _positionBits;
+
+  return int32_t(uint32_t(diff) << shift) >> shift;
+}
+
+void __not_in_flash_func(Encoder::_loop)() {
   // Read the encoder position
 
   _readPosition();
+  _samples = _samples + 1;
 
   // Calculate the difference between the new position and
   // the old position accounting
   // for overflow and underflow in the encoder position.
 
-  int32_t diff = _position - _lastPosition;
-  int32_t maxResolutionValue = (1 << _setup.resolutionBits);
+  const int32_t rawDiff = _wrap(_position - _lastPosition);
 
-  if (diff > maxResolutionValue / 2) {
-    diff -= maxResolutionValue;
-  } else if (diff < -maxResolutionValue / 2) {
-    diff += maxResolutionValue;
+  critical_section_enter_blocking(&_cs);
+
+  // A new table is taken up at the previous angle, so that
+  // replacing it does not move the position
+
+  if (_correctionChanged) {
+    _lastCorrection = _correction[_correctionBin(_lastPosition)];
+    _correctionChanged = false;
   }
 
+  // The correction for the new angle replaces the one for the
+  // old angle, so only the difference between them is applied
+
+  const int32_t correction = _correction[_correctionBin(_position)];
+  const int32_t diff = rawDiff - (correction - _lastCorrection);
+
+  _lastCorrection = correction;
+
   // Update state
-  critical_section_enter_blocking(&_cs);
   _positionDifference += diff;
   _cumulativePosition = _cumulativePosition + int64_t(diff);
   critical_section_exit(&_cs);
+
+  _recordDiff(diff);
+
+  // A sample that arrives more than two intervals after the
+  // previous one means that the timer could not keep up
+
+  int64_t interval = absolute_time_diff_us(_lastPositionReadTime, _positionReadTime);
+
+  if (interval > 2 * int64_t(_interval)) {
+    _deadlineMisses++;
+    _recordDiff(0, true);
+    flightRecorder.record(EventDeadlineMiss, int32_t(interval));
+
+    if (flightRecorder.freezeOnDeadlineMiss()) {
+      flightRecorder.freeze(FreezeDeadlineMiss);
+    }
+  }
+
+  _adaptUpdateInterval(diff);
+
+  if (_calibrationRevolutions) {
+    _learn(rawDiff);
+  }
 }
 
 /**
- * @brief Convert gray code to binary
- * 
- * @param gray Gray code encoded value
- * @return uint32_t The decoded binary value
- **/
-uint32_t inline Encoder::_grayToBinary(uint32_t gray) {
-  uint32_t binary;
-  asm volatile (
-    "mov %0, %1\n"          // binary = gray
-    "lsr r2, %1, #1\n"      // mask = gray >> 1
-    "1:\n"
-    "cmp r2, #0\n"          // while (mask != 0)
-    "beq 2f\n"
-    "eor %0, %0, r2\n"      // binary ^= mask
-    "lsr r2, r2, #1\n"      // mask >>= 1
-    "b 1b\n"
-    "2:\n"
-    : "=&r" (binary)        // output
-    : "r" (gray)            // input
-    : "r2"                  // clobbered register
-  );
-  return binary;
-}
-
-
-bool _encoderSimulatorTimerCallback(repeating_timer_t *rt) {
+ * @brief Compare the uncorrected position with where a spindle
+ *        turning steadily at the speed of the last revolution would
+ *        be, and add the difference to the sums for its angle.
+ *
+ * The differences also hold an offset that varies from one
+ * revolution to the next, as each is timed from whichever sample
+ * crossed into it. It is spread evenly over the angles and is taken
+ * out along with the mean once learning is over.
+ */
+void __not_in_flash_func(Encoder::_learn)(int32_t diff) {
+  _calibrationPosition += diff;
+
+  const int64_t travelled = _calibrationPosition - _revolutionStart;
+  const int64_t elapsed = absolute_time_diff_us(_revolutionStartTime, _positionReadTime);
+
+  if (llabs(travelled) >= int64_t(_setup.stepsPerRevolution)) {
+    // The first crossing only starts a revolution to be timed,
+    // and learning starts once one has been
+
+    if (_revolutionTimed) {
+      if (_countsPerMicrosecond != 0 && --_calibrationRevolutions == 0) {
+        _calibrationLearned = true;
+      }
+
+      _countsPerMicrosecond = float(travelled) / float(elapsed);
+    }
+
+    _revolutionTimed = true;
+    _revolutionStart = _calibrationPosition;
+    _revolutionStartTime = _positionReadTime;
+    return;
+  }
+
+  // A held position is not where the spindle was at this time
+
+  if (_countsPerMicrosecond == 0 || _consecutiveHolds) {
+    return;
+  }
+
+  const uint32_t bin = _correctionBin(_position);
+
+  _calibrationSum[bin] += float(travelled) - _countsPerMicrosecond * float(elapsed);
+  _calibrationCount[bin]++;
+}
+
+void Encoder::calibrate(uint32_t revolutions) {
+  // Everything the loop learns from is set up before it is
+  // told to start
+
+  _calibrationRevolutions = 0;
+  _calibrationLearned = false;
+  _revolutionTimed = false;
+  _calibrationPosition = 0;
+  _revolutionStart = 0;
+  _revolutionStartTime = get_absolute_time();
+  _countsPerMicrosecond = 0;
+
+  memset(_calibrationSum, 0, sizeof(_calibrationSum));
+  memset(_calibrationCount, 0, sizeof(_calibrationCount));
+
+  __compiler_memory_barrier();
+  _calibrationRevolutions = revolutions;
+}
+
+bool Encoder::finishCalibration() {
+  if (!_calibrationLearned || calibrating()) {
+    return false;
+  }
+
+  const uint32_t bins = 1u << (_setup.resolutionBits - _correctionShift);
+
+  float sum = 0;
+  uint32_t count = 0;
+
+  for (uint32_t bin = 0; bin < bins; bin++) {
+    if (_calibrationCount[bin] == 0) {
+      return false;
+    }
+
+    sum += _calibrationSum[bin];
+    count += _calibrationCount[bin];
+  }
+
+  const float mean = sum / count;
+  int16_t correction[ENCODER_CORRECTION_BINS] = {};
+
+  for (uint32_t bin = 0; bin < bins; bin++) {
+    correction[bin] = int16_t(lroundf(_calibrationSum[bin] / _calibrationCount[bin] - mean));
+  }
+
+  _replaceCorrection(correction);
+  _calibrationLearned = false;
+
+  return true;
+}
+
+bool Encoder::loadCorrection() {
+  const bool loaded = _readCorrection();
+
+  _correctionLoaded = true;
+
+  return loaded;
+}
+
+void Encoder::awaitCorrection() {
+  while (!_correctionLoaded) {
+    tight_loop_contents();
+  }
+}
+
+bool Encoder::_readCorrection() {
+  AllocationPermit permit; // LittleFS allocates its file handles
+
+  File file = LittleFS.open(_setup.correctionPath, "r");
+
+  if (!file) {
+    return false;
+  }
+
+  // A table learned at another resolution does not apply
+
+  uint32_t header[2];
+  int16_t correction[ENCODER_CORRECTION_BINS];
+
+  const bool complete = file.read((uint8_t *)header, sizeof(header)) == sizeof(header) &&
+                        header[0] == ENCODER_CORRECTION_MAGIC && header[1] == _setup.resolutionBits &&
+                        file.read((uint8_t *)correction, sizeof(correction)) == sizeof(correction);
+
+  file.close();
+
+  // The other core waits in awaitCorrection() before it starts
+  // sampling, so the table can be filled in without the lock
+
+  if (complete) {
+    memcpy(_correction, correction, sizeof(_correction));
+  }
+
+  return complete;
+}
+
+/**
+ * @brief Swap in a new correction table, for the loop to take up
+ *        on its next sample
+ */
+void Encoder::_replaceCorrection(const int16_t *correction) {
+  critical_section_enter_blocking(&_cs);
+  memcpy(_correction, correction, sizeof(_correction));
+  _correctionChanged = true;
+  critical_section_exit(&_cs);
+}
+
+bool Encoder::saveCorrection() {
+  AllocationPermit permit; // LittleFS allocates its file handles
+
+  File file = LittleFS.open(_setup.correctionPath, "w");
+
+  if (!file) {
+    return false;
+  }
+
+  const uint32_t header[2] = { ENCODER_CORRECTION_MAGIC, _setup.resolutionBits };
+
+  const bool complete = file.write((const uint8_t *)header, sizeof(header)) == sizeof(header) &&
+                        file.write((const uint8_t *)_correction, sizeof(_correction)) == sizeof(_correction);
+
+  file.close();
+
+  return complete;
+}
+
+void Encoder::clearCorrection() {
+  const int16_t correction[ENCODER_CORRECTION_BINS] = {};
+
+  _replaceCorrection(correction);
+  saveCorrection();
+}
+
+int32_t Encoder::correctionPeak() {
+  int32_t peak = 0;
+
+  for (const int16_t correction : _correction) {
+    peak = std::max<int32_t>(peak, abs(correction));
+  }
+
+  return peak;
+}
+
+/**
+ * @brief Pick the next poll interval from the latest sample.
+ *
+ * While fast sampling is requested the full rate is used. Otherwise
+ * the interval aims for countsPerSample counts per sample, between
+ * the full rate and the idle rate. Shortening happens immediately,
+ * so the encoder is back at speed within one sample of the spindle
+ * starting, while lengthening waits for slowDownDelay and at most
+ * doubles the interval each time.
+ */
+/**
+ * @brief Sum the counts into one flight recorder entry per summary
+ *        interval, since at full rate an entry per sample would fill
+ *        the ring in milliseconds
+ */
+void __not_in_flash_func(Encoder::_recordDiff)(int32_t diff, bool flush) {
+  _unrecordedDiff += diff;
+
+  if (_unrecordedDiff == 0) {
+    return;
+  }
+
+  const uint32_t now = time_us_32();
+
+  if (flush || now - _recordTime >= FLIGHT_RECORDER_SUMMARY_INTERVAL) {
+    flightRecorder.record(EventEncoderDelta, _unrecordedDiff);
+    _unrecordedDiff = 0;
+    _recordTime = now;
+  }
+}
+
+void __not_in_flash_func(Encoder::_adaptUpdateInterval)(int32_t diff) {
+  const uint32_t current = _interval;
+  uint32_t target;
+
+  if (_fastSampling) {
+    target = _setup.updateInterval;
+  } else if (diff == 0) {
+    target = _setup.idleUpdateInterval;
+  } else {
+    target = std::clamp<uint32_t>(current * _setup.countsPerSample / abs(diff), _setup.updateInterval, _setup.idleUpdateInterval);
+  }
+
+  if (target < current) {
+    _interval = target;
+    _slowDownTime = make_timeout_time_ms(_setup.slowDownDelay);
+  } else if (target > current && absolute_time_diff_us(_slowDownTime, get_absolute_time()) > 0) {
+    _interval = std::min(target, current * 2);
+    _slowDownTime = make_timeout_time_ms(_setup.slowDownDelay);
+  }
+
+  // The timer reads the delay back after every callback
+
+  _timer.delay_us = _interval;
+}
+
+bool __not_in_flash_func(_encoderSimulatorTimerCallback)(repeating_timer_t *rt) {
   EncoderSimulator *encoder = (EncoderSimulator *)rt->user_data;
   encoder->_loop();
   return true;
@@ -98,7 +501,8 @@ void EncoderSimulator::begin() {
   _positionDifference = 0;
   _cumulativePosition = 0;
 
-  add_repeating_timer_us(_setup.updateInterval, _encoderTimerCallback, this, &_timer);
+  _interval = _setup.updateInterval;
+  add_repeating_timer_us(_interval, _encoderSimulatorTimerCallback, this, &_timer);
 }
 
 void EncoderSimulator::speed(float speed) {
@@ -108,6 +512,13 @@ void EncoderSimulator::speed(float speed) {
   critical_section_exit(&_cs);
 }
 
+void EncoderSimulator::resume(int64_t position) {
+  critical_section_enter_blocking(&_cs);
+  _cumulativePosition = position;
+  _internalPosition = position;
+  critical_section_exit(&_cs);
+}
+
 float EncoderSimulator::speed() {
   return _speed;
 }
@@ -128,12 +539,17 @@ EncoderDirection EncoderSimulator::direction() {
   return _direction;
 }
 
-void EncoderSimulator::_loop() {
-  _internalPosition += _speed * _setup.stepsPerRevolution / 60.0 * _setup.updateInterval / 1000000.0;
+void __not_in_flash_func(EncoderSimulator::_loop)() {
+  _internalPosition += _speed * _setup.stepsPerRevolution / 60.0 * _interval / 1000000.0;
+  _samples = _samples + 1;
 
   // Update state
   critical_section_enter_blocking(&_cs);
-  _positionDifference += _internalPosition - _cumulativePosition;
-  _cumulativePosition += _internalPosition - _cumulativePosition;
+  int32_t diff = _internalPosition - _cumulativePosition;
+  _positionDifference += diff;
+  _cumulativePosition += diff;
   critical_section_exit(&_cs);
+
+  _recordDiff(diff);
+  _adaptUpdateInterval(diff);
 }
\ No newline at end of file
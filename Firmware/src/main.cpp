@@ -3,38 +3,122 @@
 
 #include <Config.hpp>
 
-#include <Leadscrew.hpp>
-#include <Encoder.hpp>
-#include <Stepper.hpp>
+#include <Machine.hpp>
 #include <Tachometer.hpp>
 #include <Display.hpp>
 #include <SerialDebug.hpp>
+#include <ClockProfiles.hpp>
+#include <FlightRecorder.hpp>
+#include <MemoryMonitor.hpp>
+#include <EmergencyStop.hpp>
+#include <PositionCheckpoint.hpp>
 
 
+MemoryMonitor memoryMonitor;
+
+FlightRecorder flightRecorder({
+  Config.FlightRecorderPath,
+  Config.FlightRecorderFreezeOnMiss,
+});
+
 Stepper stepper({
   Config.StepperDirectionPin,
   Config.StepperPulsePin,
   Config.StepperStepsPerRevolution,
+  Config.StepperBacklash,
 });
 
-#ifdef SIMULATE_ENCODER
-EncoderSimulator encoder({
-#else // SIMULATE_ENCODER
-Encoder encoder({
-#endif // SIMULATE_ENCODER
+Machine::SpindleEncoder encoder({
   Config.EncoderMOSIPin,
   Config.EncoderClkPin,
   Config.EncoderClockSpeed,
   Config.EncoderResolutionBits,
   Config.EncoderStepsPerRevolution,
   Config.EncoderUpdateInterval,
+  Config.EncoderIdleUpdateInterval,
+  Config.EncoderSlowDownDelay,
+  Config.EncoderCountsPerSample,
+  Config.EncoderFrameBits,
+  Config.EncoderMultiTurn,
+  Config.EncoderStatusBits,
+  Config.EncoderStatusErrorMask,
+  Config.EncoderParity,
+  Config.EncoderMaxSpeed,
+  Config.EncoderMaxRetries,
+  Config.EncoderRetryDelay,
+  Config.EncoderMaxHeldSamples,
+  Config.EncoderCorrectionPath,
+});
+
+// The two feedback encoders are set up differently, so
+// each machine's is made by its own specialization
+
+template <typename FeedbackEncoder>
+FeedbackEncoder _feedbackEncoder();
+
+template <>
+QuadratureEncoder _feedbackEncoder() {
+  return QuadratureEncoder({
+    pio1,
+    Config.FeedbackPinA,
+    Config.FeedbackMaxCountRate,
+  });
+}
+
+template <>
+QuadratureEncoderSimulator _feedbackEncoder() {
+  return QuadratureEncoderSimulator({
+    Config.StepperPulsePin,
+    Config.StepperDirectionPin,
+    Config.FeedbackCountsPerRevolution / Config.StepperStepsPerRevolution,
+    Config.FeedbackSimulatorMaxStepRate,
+    Config.FeedbackSimulatorBacklash,
+    Config.FeedbackSimulatorLag,
+  });
+}
+
+Machine::FeedbackEncoder feedback = _feedbackEncoder<Machine::FeedbackEncoder>();
+
+QuadratureEncoder handwheel({
+  pio1,
+  Config.HandwheelPinA,
+  Config.HandwheelMaxCountRate,
+});
+
+EmergencyStop emergencyStop({
+  Config.EStopPin,
+  Config.EStopTripHigh,
+  Config.StepperPulsePin,
 });
 
-Leadscrew leadScrew({
+MachineLeadscrew leadScrew({
   stepper,
   encoder,
   Config.LeadScrewPitch,
   Config.LeadScrewReductionFactor,
+  Config.LeadScrewRapidSpeed,
+  Config.LeadScrewRapidAcceleration,
+  Config.LeadScrewInterpolationInterval,
+  Config.LeadScrewMaxStepRate,
+  Config.LeadScrewStepRateWarning,
+  Config.FeedbackEnabled ? &feedback : nullptr,
+  Config.FeedbackCountsPerRevolution / Config.StepperStepsPerRevolution,
+  Config.FeedbackOnMotor && !Machine::simulated, // The simulator counts carriage motion
+  Config.FeedbackDeadband,
+  Config.FeedbackMaxCorrection,
+  Config.FeedbackCorrectionRate,
+  Config.FeedbackLag,
+  Config.FeedbackTolerance,
+  Config.EStopEnabled ? &emergencyStop : nullptr,
+  Config.HandwheelEnabled ? &handwheel : nullptr,
+  Config.HandwheelCountsPerDetent,
+  Config.HandwheelResolution,
+  Config.HandwheelFastRate,
+  Config.HandwheelMaxScale,
+  Config.HandwheelMaxLag,
+  Config.LeadScrewChipBreakRevolutions,
+  Config.LeadScrewChipBreakDwell,
+  Config.LeadScrewChipBreakRetract,
 });
 
 Tachometer tachometer(encoder);
@@ -43,20 +127,57 @@ Display display({
   Config.DisplayClkPin,
   Config.DisplayDioPin,
   Config.DisplayStbPin,
-  Config.DisplayTPIThreads,
-  Config.DisplayMetricThreads,
+  Config.DisplayTPIThreads.data(),
+  Config.DisplayTPIThreads.size(),
+  Config.DisplayMetricThreads.data(),
+  Config.DisplayMetricThreads.size(),
   Config.DisplayDefaultTPIThreadIndex,
   Config.DisplayDefaultMetricThreadIndex,
   Config.DisplayMinPowerFeedIPR,
   Config.DisplayMaxPowerFeedIPR,
   Config.DisplayDefaultPowerFeedIPR,
+  Config.DisplayMinFeedIPM,
+  Config.DisplayMaxFeedIPM,
+  Config.DisplayDefaultFeedIPM,
+  Config.DisplayFeedStepIPM,
+  Config.DisplayMinFeedMMPM,
+  Config.DisplayMaxFeedMMPM,
+  Config.DisplayDefaultFeedMMPM,
+  Config.DisplayFeedStepMMPM,
+  Config.DisplayMaxStarts,
+  Config.DisplayDefaultCycleLength,
+  Config.DisplayCycleStepInches,
+  Config.DisplayCycleStepMillimeters,
   leadScrew,
   tachometer,
+  encoder,
   Config.DisplayBanner,
   Config.DisplayUpdateInterval,
   Config.DisplayLoopInterval,
   Config.DisplayButtonQueueSize,
   Config.DisplayAutoOffInterval,
+  Config.DisplayMessageInterval,
+});
+
+PositionCheckpoint checkpoint({
+  leadScrew,
+  encoder,
+  display,
+  Config.CheckpointPath,
+  Config.CheckpointInterval,
+  Config.CheckpointSaveDelay,
+});
+
+ClockProfiles clockProfiles({
+  leadScrew,
+  encoder,
+  Config.FeedbackEnabled ? &feedback : nullptr,
+  Config.HandwheelEnabled ? &handwheel : nullptr,
+  tachometer,
+  Config.ClockAutomatic,
+  { Config.ClockIdleKHz, Config.ClockNominalKHz, Config.ClockHighSpeedKHz },
+  Config.ClockHighSpeedRPM,
+  Config.ClockIdleDelay,
 });
 
 SerialDebug serialDebug({
@@ -64,22 +185,101 @@ SerialDebug serialDebug({
   leadScrew,
   display,
   tachometer,
+  flightRecorder,
+  memoryMonitor,
+  feedback,
+  emergencyStop,
+  checkpoint,
+  clockProfiles,
   Config.SerialDebugUpdateInterval,
+  Config.EncoderCalibrationRevolutions,
+  Config.CheckpointSaveDelay,
 });
 
 void setup1() {
+  memoryMonitor.paintStack();
+
+  // The emergency stop's interrupt is serviced on this core,
+  // next to the loop that it stops. Setting up the stepper's
+  // pins would undo its override of the pulse output, so the
+  // stepper comes first.
+
+  stepper.begin();
+
+  if (Config.EStopEnabled) {
+    emergencyStop.begin();
+  }
+
+  // The position starts out in the corrected angles, so the
+  // table read by the other core has to be in place first
+
+  encoder.awaitCorrection();
   encoder.begin();
   leadScrew.begin();
+
+  // The saved positions are read by the other core, which
+  // owns the filesystem, and are taken up before the loop
+  // starts moving anything
+
+  if (Config.CheckpointEnabled) {
+    checkpoint.resume(encoder);
+  }
+
+  memoryMonitor.ready();
   leadScrew.loop();
 }
 
 void setup() {
-  stepper.begin();
+  memoryMonitor.paintStack();
+
+  flightRecorder.begin();
+
+  // Loaded before the checkpoint, which is resumed in the
+  // corrected positions it was saved in
+
+  encoder.loadCorrection();
+
+  if (Config.CheckpointEnabled) {
+    checkpoint.begin();
+  }
+
+  if (Config.FeedbackEnabled) {
+    feedback.begin();
+  }
+
+  if (Config.HandwheelEnabled) {
+    handwheel.begin();
+  }
+
   tachometer.begin();
   display.begin();
-  // Serial.begin(115200);
-  // serialDebug.begin();
+
+  // Starting the display resets the pitch and any cycle, so a
+  // saved cycle is only carried on with once it has started
+
+  if (Config.CheckpointEnabled) {
+    checkpoint.resumeCycle();
+  }
+
+  clockProfiles.begin();
+  serialDebug.begin();
+
+  memoryMonitor.ready();
 }
 
 void loop() {
+  serialDebug.loop();
+
+  if (Config.CheckpointEnabled) {
+    checkpoint.loop();
+  }
+
+  clockProfiles.loop();
+
+  // Saving to flash stalls core 1, so a frozen recording
+  // is only written out once the carriage is at rest
+
+  if (flightRecorder.frozen() && leadScrew.atRest(Config.CheckpointSaveDelay)) {
+    flightRecorder.save();
+  }
 }
\ No newline at end of file
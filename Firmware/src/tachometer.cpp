@@ -1,6 +1,6 @@
 #include <Tachometer.hpp>
 
-bool _tachometerTimerCallback(repeating_timer_t *rt) {
+bool __not_in_flash_func(_tachometerTimerCallback)(repeating_timer_t *rt) {
   Tachometer *tachometer = (Tachometer *)rt->user_data;
   tachometer->_loop();
   return true;
@@ -15,7 +15,7 @@ void Tachometer::begin() {
   add_repeating_timer_us(10000, _tachometerTimerCallback, this, &_timer);
 }
 
-void Tachometer::_loop() {
+void __not_in_flash_func(Tachometer::_loop)() {
   int64_t position = _encoder.cumulativePosition();
   absolute_time_t positionReadTime = get_absolute_time();
 
@@ -26,7 +26,7 @@ void Tachometer::_loop() {
 
   // Save the current speed in the history buffer
 
-  memcpy(&_speedHistory[1], _speedHistory, sizeof(float) * 9);
+  memmove(&_speedHistory[1], _speedHistory, sizeof(float) * 9);
 
   _speedHistory[0] = currentSpeed;
 
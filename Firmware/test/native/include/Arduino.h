@@ -0,0 +1,247 @@
+#pragma once
+
+// Minimal stand-ins for the parts of the Arduino-Pico core and the
+// Pico SDK used by the hot-path sources, so that they can be built
+// and benchmarked on the host. Hardware access does nothing beyond
+// keeping GPIO levels, and time is taken from the host's steady clock.
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+typedef unsigned int uint;
+typedef uint8_t pin_size_t;
+typedef uint64_t absolute_time_t;
+
+#define HIGH 1
+#define LOW 0
+#define GPIO_OUT true
+#define GPIO_IN false
+#define GPIO_FUNC_SPI 1
+#define GPIO_IRQ_EDGE_FALL 0x4u
+#define GPIO_IRQ_EDGE_RISE 0x8u
+#define IO_IRQ_BANK0 13
+#define PICO_HIGHEST_IRQ_PRIORITY 0x00
+#define GPIO_OVERRIDE_NORMAL 0
+#define GPIO_OVERRIDE_LOW 2
+#define SPI_CPOL_0 0
+#define SPI_CPHA_1 1
+#define SPI_MSB_FIRST 1
+
+// Everything runs from RAM on the host
+#define __not_in_flash(group)
+#define __force_inline inline __attribute__((always_inline))
+#define __not_in_flash_func(func_name) func_name
+
+
+// Time
+
+inline uint64_t time_us_64() {
+  static const auto boot = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+inline uint32_t time_us_32() { return uint32_t(time_us_64()); }
+inline absolute_time_t get_absolute_time() { return time_us_64(); }
+inline absolute_time_t make_timeout_time_ms(uint32_t ms) { return time_us_64() + uint64_t(ms) * 1000; }
+inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return int64_t(to - from); }
+inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+inline uint32_t to_ms_since_boot(absolute_time_t t) { return uint32_t(t / 1000); }
+inline unsigned long millis() { return (unsigned long)(time_us_64() / 1000); }
+inline unsigned long micros() { return (unsigned long)time_us_64(); }
+inline void delay(unsigned long) {}
+inline void busy_wait_us_32(uint32_t) {}
+
+[[noreturn]] inline void panic(const char *format, ...) {
+  va_list arguments;
+
+  va_start(arguments, format);
+  vfprintf(stderr, format, arguments);
+  va_end(arguments);
+
+  abort();
+}
+
+
+// Repeating timers never fire; the benchmarks call the loops directly
+
+typedef struct repeating_timer {
+  int64_t delay_us;
+  void *user_data;
+  bool (*callback)(struct repeating_timer *);
+} repeating_timer_t;
+
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t *);
+
+inline bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *timer) {
+  timer->delay_us = delay_us;
+  timer->callback = callback;
+  timer->user_data = user_data;
+  return true;
+}
+
+inline bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *timer) {
+  return add_repeating_timer_us(int64_t(delay_ms) * 1000, callback, user_data, timer);
+}
+
+inline bool cancel_repeating_timer(repeating_timer_t *) { return true; }
+
+
+// Synchronization; the host build is single threaded
+
+typedef struct { int unused; } critical_section_t;
+
+inline void critical_section_init(critical_section_t *) {}
+inline void critical_section_init_with_lock_num(critical_section_t *, uint) {}
+inline void critical_section_enter_blocking(critical_section_t *) {}
+inline void critical_section_exit(critical_section_t *) {}
+inline uint32_t save_and_disable_interrupts() { return 0; }
+inline void restore_interrupts(uint32_t) {}
+inline uint get_core_num() { return 0; }
+inline void __compiler_memory_barrier() {}
+inline void tight_loop_contents() {}
+
+
+// GPIO
+
+typedef void (*irq_handler_t)(void);
+
+// Levels are kept, and a rising edge on a pin with its interrupt
+// enabled calls the handler straight away, so that a simulator
+// watching the step pulses sees them on the host too
+
+struct _HostGpio {
+  bool level[32];
+  uint32_t enabledEvents[32];
+  uint32_t events[32];
+  irq_handler_t handlers[32];
+};
+
+inline _HostGpio &_hostGpio() {
+  static _HostGpio gpio;
+  return gpio;
+}
+
+inline void gpio_put(uint pin, bool value) {
+  _HostGpio &gpio = _hostGpio();
+  const bool rising = value && !gpio.level[pin];
+
+  gpio.level[pin] = value;
+
+  if (rising && (gpio.enabledEvents[pin] & GPIO_IRQ_EDGE_RISE) && gpio.handlers[pin]) {
+    gpio.events[pin] |= GPIO_IRQ_EDGE_RISE;
+    gpio.handlers[pin]();
+  }
+}
+
+inline bool gpio_get(uint pin) { return _hostGpio().level[pin]; }
+
+inline void gpio_set_irq_enabled(uint pin, uint32_t events, bool enabled) {
+  _HostGpio &gpio = _hostGpio();
+  gpio.enabledEvents[pin] = enabled ? gpio.enabledEvents[pin] | events : gpio.enabledEvents[pin] & ~events;
+}
+
+inline void gpio_acknowledge_irq(uint pin, uint32_t events) { _hostGpio().events[pin] &= ~events; }
+inline uint32_t gpio_get_irq_event_mask(uint pin) { return _hostGpio().events[pin]; }
+inline void gpio_add_raw_irq_handler(uint pin, irq_handler_t handler) { _hostGpio().handlers[pin] = handler; }
+
+inline void gpio_init(uint) {}
+inline void gpio_set_dir(uint, bool) {}
+inline void gpio_pull_up(uint) {}
+inline void gpio_set_outover(uint, uint) {}
+inline void gpio_set_function(uint, int) {}
+inline void irq_set_enabled(uint, bool) {}
+inline void irq_set_priority(uint, uint8_t) {}
+
+
+// SPI; reads return whatever is already in the buffer
+
+typedef struct { int unused; } spi_inst_t;
+
+inline spi_inst_t *_hostSpi(int index) {
+  static spi_inst_t instances[2];
+  return &instances[index];
+}
+
+#define spi0 (_hostSpi(0))
+#define spi1 (_hostSpi(1))
+
+inline uint spi_init(spi_inst_t *, uint baudrate) { return baudrate; }
+inline void spi_set_format(spi_inst_t *, uint, int, int, int) {}
+inline int spi_read_blocking(spi_inst_t *, uint8_t, uint8_t *, size_t length) { return int(length); }
+inline uint spi_set_baudrate(spi_inst_t *, uint baudrate) { return baudrate; }
+
+
+// PIO; state machines always report a count of zero
+
+typedef struct { int unused; } pio_hw_t;
+typedef pio_hw_t *PIO;
+
+inline PIO _hostPio(int index) {
+  static pio_hw_t instances[2];
+  return &instances[index];
+}
+
+#define pio0 (_hostPio(0))
+#define pio1 (_hostPio(1))
+
+typedef struct { uint32_t clkdiv, execctrl, shiftctrl, pinctrl; } pio_sm_config;
+typedef struct pio_program { const uint16_t *instructions; uint8_t length; int8_t origin; } pio_program_t;
+
+enum { PIO_FIFO_JOIN_NONE = 0, PIO_FIFO_JOIN_TX = 1, PIO_FIFO_JOIN_RX = 2 };
+enum clock_index { clk_gpout0, clk_gpout1, clk_gpout2, clk_gpout3, clk_ref, clk_sys, clk_peri, clk_usb, clk_adc, clk_rtc };
+
+inline uint32_t clock_get_hz(enum clock_index) { return 133000000; }
+inline uint pio_add_program(PIO, const pio_program_t *) { return 0; }
+inline int pio_claim_unused_sm(PIO, bool) { return 0; }
+inline pio_sm_config pio_get_default_sm_config() { return {}; }
+inline void pio_sm_set_consecutive_pindirs(PIO, uint, uint, uint, bool) {}
+inline void sm_config_set_in_pins(pio_sm_config *, uint) {}
+inline void sm_config_set_jmp_pin(pio_sm_config *, uint) {}
+inline void sm_config_set_in_shift(pio_sm_config *, bool, bool, uint) {}
+inline void sm_config_set_fifo_join(pio_sm_config *, int) {}
+inline void sm_config_set_clkdiv(pio_sm_config *, float) {}
+inline void sm_config_set_wrap(pio_sm_config *, uint, uint) {}
+inline void pio_sm_init(PIO, uint, uint, const pio_sm_config *) {}
+inline void pio_sm_set_enabled(PIO, uint, bool) {}
+inline void pio_sm_set_clkdiv(PIO, uint, float) {}
+inline uint pio_sm_get_rx_fifo_level(PIO, uint) { return 0; }
+inline uint32_t pio_sm_get_blocking(PIO, uint) { return 0; }
+inline uint32_t pio_sm_get(PIO, uint) { return 0; }
+
+
+// Output
+
+class Print {
+public:
+  virtual ~Print() {}
+
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    return fwrite(buffer, 1, size, stdout);
+  }
+
+  size_t print(const char *text) {
+    return write((const uint8_t *)text, strlen(text));
+  }
+
+  size_t println(const char *text = "") {
+    return print(text) + print("\r\n");
+  }
+
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    char buffer[256];
+    va_list args;
+
+    va_start(args, format);
+    const int length = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+
+    return length > 0 ? write((const uint8_t *)buffer, std::min<size_t>(length, sizeof(buffer) - 1)) : 0;
+  }
+};
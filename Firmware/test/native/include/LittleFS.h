@@ -0,0 +1,22 @@
+#pragma once
+
+#include <Arduino.h>
+
+// There is no flash filesystem on the host; files never open
+
+class File {
+public:
+  explicit operator bool() const { return false; }
+
+  size_t read(uint8_t *, size_t) { return 0; }
+  size_t write(const uint8_t *, size_t size) { return size; }
+  void close() {}
+};
+
+class LittleFSHost {
+public:
+  bool begin() { return true; }
+  File open(const char *, const char *) { return File(); }
+};
+
+inline LittleFSHost LittleFS;
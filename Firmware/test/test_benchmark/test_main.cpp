@@ -0,0 +1,462 @@
+#include <Arduino.h>
+#include <unity.h>
+
+#include <Config.hpp>
+#include <Machine.hpp>
+#include <Tachometer.hpp>
+#include <FlightRecorder.hpp>
+
+
+// Microbenchmarks for the functions on the hot path. Each benchmark
+// prints one JSON line with the minimum, mean and maximum time taken
+// by a single call, so that runs can be compared to catch regressions.
+//
+// On the Pico times are CPU cycles read from SysTick; on the host
+// they are nanoseconds from the steady clock. Maximums include any
+// interrupt that happened to fire during a call.
+
+#define BENCHMARK_ITERATIONS 1000
+
+#ifdef ARDUINO
+#include "hardware/structs/systick.h"
+
+#define BENCHMARK_UNIT "cycles"
+
+static void _startTimer() {
+  systick_hw->csr = 0;
+  systick_hw->rvr = 0x00FFFFFF;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5; // Enabled, clocked by the processor, no interrupt
+}
+
+static inline uint32_t _readTimer() {
+  return systick_hw->cvr;
+}
+
+static inline uint32_t _elapsed(uint32_t start, uint32_t end) {
+  return (start - end) & 0x00FFFFFF; // SysTick counts down
+}
+#else // ARDUINO
+#include <chrono>
+
+#define BENCHMARK_UNIT "ns"
+
+static void _startTimer() {}
+
+static inline uint32_t _readTimer() {
+  return uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static inline uint32_t _elapsed(uint32_t start, uint32_t end) {
+  return end - start;
+}
+#endif // ARDUINO
+
+
+static uint32_t _overhead = 0;
+static volatile uint32_t _sink;
+
+
+/**
+ * @brief Time a number of calls to body, calling prepare
+ *        before each of them outside of the timed section
+ */
+template <typename Prepare, typename Body>
+static void _benchmark(const char *name, Prepare prepare, Body body) {
+  uint32_t minimum = UINT32_MAX;
+  uint32_t maximum = 0;
+  uint64_t total = 0;
+
+  for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    prepare();
+
+    const uint32_t start = _readTimer();
+    body();
+    const uint32_t end = _readTimer();
+
+    uint32_t elapsed = _elapsed(start, end);
+    elapsed = elapsed > _overhead ? elapsed - _overhead : 0;
+
+    minimum = std::min(minimum, elapsed);
+    maximum = std::max(maximum, elapsed);
+    total += elapsed;
+  }
+
+  char line[160];
+
+  snprintf(line, sizeof(line), "{\"benchmark\":\"%s\",\"unit\":\"" BENCHMARK_UNIT "\",\"iterations\":%d,\"min\":%lu,\"mean\":%lu,\"max\":%lu}",
+           name,
+           BENCHMARK_ITERATIONS,
+           (unsigned long)minimum,
+           (unsigned long)(total / BENCHMARK_ITERATIONS),
+           (unsigned long)maximum);
+
+  TEST_MESSAGE(line);
+}
+
+template <typename Body>
+static void _benchmark(const char *name, Body body) {
+  _benchmark(name, []() {}, body);
+}
+
+
+// Expose the protected parts of each class under test
+
+class BenchmarkEncoder : public Encoder {
+public:
+  using Encoder::Encoder;
+  using Encoder::_grayToBinary;
+  using Encoder::_decodeFrame;
+  using Encoder::_loop;
+
+  /**
+   * @brief Start the encoder without its timer, so that the
+   *        benchmark is the only one calling the loop
+   */
+  void start() {
+    begin();
+    cancel_repeating_timer(&_timer);
+  }
+
+  /**
+   * @brief Pretend the spindle has moved
+   */
+  void move(int32_t counts) {
+    critical_section_enter_blocking(&_cs);
+    _positionDifference += counts;
+    _cumulativePosition += counts;
+    critical_section_exit(&_cs);
+  }
+};
+
+// The benchmarks run against the hardware machine, with the SDK
+// calls stubbed out when built for the host. The simulated one is
+// only used to check the closed loop against a lagging encoder.
+
+typedef MachineLeadscrewFor<HardwareMachine> HardwareLeadscrew;
+typedef MachineLeadscrewFor<SimulatedMachine> SimulatedLeadscrew;
+
+class BenchmarkLeadscrew : public HardwareLeadscrew {
+public:
+  using HardwareLeadscrew::HardwareLeadscrew;
+  using HardwareLeadscrew::_iterate;
+};
+
+class BenchmarkSimulatedLeadscrew : public SimulatedLeadscrew {
+public:
+  using SimulatedLeadscrew::SimulatedLeadscrew;
+  using SimulatedLeadscrew::_iterate;
+
+  /**
+   * @brief Iterate for the given number of microseconds
+   */
+  void run(uint32_t duration) {
+    const uint32_t start = time_us_32();
+
+    while (time_us_32() - start < duration) {
+      _iterate();
+    }
+  }
+};
+
+class BenchmarkTachometer : public Tachometer {
+public:
+  using Tachometer::Tachometer;
+  using Tachometer::_loop;
+
+  void start() {
+    begin();
+    cancel_repeating_timer(&_timer);
+  }
+};
+
+
+FlightRecorder flightRecorder({
+  Config.FlightRecorderPath,
+  Config.FlightRecorderFreezeOnMiss,
+});
+
+Stepper stepper({
+  Config.StepperDirectionPin,
+  Config.StepperPulsePin,
+  Config.StepperStepsPerRevolution,
+  Config.StepperBacklash,
+});
+
+const EncoderSetup encoderSetup = {
+  Config.EncoderMOSIPin,
+  Config.EncoderClkPin,
+  Config.EncoderClockSpeed,
+  Config.EncoderResolutionBits,
+  Config.EncoderStepsPerRevolution,
+  Config.EncoderUpdateInterval,
+  Config.EncoderIdleUpdateInterval,
+  Config.EncoderSlowDownDelay,
+  Config.EncoderCountsPerSample,
+  Config.EncoderFrameBits,
+  Config.EncoderMultiTurn,
+  Config.EncoderStatusBits,
+  Config.EncoderStatusErrorMask,
+  Config.EncoderParity,
+  Config.EncoderMaxSpeed,
+  Config.EncoderMaxRetries,
+  Config.EncoderRetryDelay,
+  Config.EncoderMaxHeldSamples,
+  Config.EncoderCorrectionPath,
+};
+
+BenchmarkEncoder encoder(encoderSetup);
+
+BenchmarkLeadscrew leadScrew({
+  stepper,
+  encoder,
+  Config.LeadScrewPitch,
+  Config.LeadScrewReductionFactor,
+  Config.LeadScrewRapidSpeed,
+  Config.LeadScrewRapidAcceleration,
+  Config.LeadScrewInterpolationInterval,
+  Config.LeadScrewMaxStepRate,
+  Config.LeadScrewStepRateWarning,
+  nullptr,
+  Config.FeedbackCountsPerRevolution / Config.StepperStepsPerRevolution,
+  Config.FeedbackOnMotor,
+  Config.FeedbackDeadband,
+  Config.FeedbackMaxCorrection,
+  Config.FeedbackCorrectionRate,
+  Config.FeedbackLag,
+  Config.FeedbackTolerance,
+  nullptr,
+  nullptr,
+  Config.HandwheelCountsPerDetent,
+  Config.HandwheelResolution,
+  Config.HandwheelFastRate,
+  Config.HandwheelMaxScale,
+  Config.HandwheelMaxLag,
+  Config.LeadScrewChipBreakRevolutions,
+  Config.LeadScrewChipBreakDwell,
+  Config.LeadScrewChipBreakRetract,
+});
+
+BenchmarkTachometer tachometer(encoder);
+
+// The host loop steps far faster than the simulated motor
+// would stall at, so only the lag is simulated
+
+EncoderSimulator simulatedEncoder(encoderSetup);
+
+QuadratureEncoderSimulator feedback({
+  Config.StepperPulsePin,
+  Config.StepperDirectionPin,
+  Config.FeedbackCountsPerRevolution / Config.StepperStepsPerRevolution,
+  0,
+  0,
+  Config.FeedbackSimulatorLag,
+});
+
+BenchmarkSimulatedLeadscrew simulatedLeadScrew({
+  stepper,
+  simulatedEncoder,
+  Config.LeadScrewPitch,
+  Config.LeadScrewReductionFactor,
+  Config.LeadScrewRapidSpeed,
+  Config.LeadScrewRapidAcceleration,
+  Config.LeadScrewInterpolationInterval,
+  Config.LeadScrewMaxStepRate,
+  Config.LeadScrewStepRateWarning,
+  &feedback,
+  Config.FeedbackCountsPerRevolution / Config.StepperStepsPerRevolution,
+  false, // The simulator counts carriage motion
+  Config.FeedbackDeadband,
+  Config.FeedbackMaxCorrection,
+  Config.FeedbackCorrectionRate,
+  Config.FeedbackLag,
+  Config.FeedbackTolerance,
+  nullptr,
+  nullptr,
+  Config.HandwheelCountsPerDetent,
+  Config.HandwheelResolution,
+  Config.HandwheelFastRate,
+  Config.HandwheelMaxScale,
+  Config.HandwheelMaxLag,
+  Config.LeadScrewChipBreakRevolutions,
+  Config.LeadScrewChipBreakDwell,
+  Config.LeadScrewChipBreakRetract,
+});
+
+
+void test_gray_to_binary() {
+  uint32_t gray = 0;
+
+  _benchmark("encoder_gray_to_binary", [&]() {
+    _sink = encoder._grayToBinary(gray);
+    gray = (gray + 0x1357) & 0xFFFFFF;
+  });
+
+  TEST_ASSERT_EQUAL_UINT32(0x000FFF, encoder._grayToBinary(0x000800));
+  TEST_ASSERT_EQUAL_UINT32(0xFFFFFF, encoder._grayToBinary(0x800000));
+}
+
+void test_decode_frame() {
+  uint32_t gray = 0;
+  uint32_t position = 0;
+
+  _benchmark("encoder_decode_frame", [&]() {
+    _sink = encoder._decodeFrame(gray, position);
+    gray = (gray + 0x1357) & 0xFFFFFF;
+  });
+
+  TEST_ASSERT_TRUE(encoder._decodeFrame(0x000800, position));
+  TEST_ASSERT_EQUAL_UINT32(0x000FFF, position);
+}
+
+void test_encoder_loop() {
+  _benchmark("encoder_loop", []() {
+    encoder._loop();
+  });
+}
+
+void test_ratio() {
+  uint8_t tpi = 8;
+  float pitch = 0.5;
+
+  _benchmark("leadscrew_thread_tpi", [&]() {
+    leadScrew.threadTPI(tpi);
+    tpi = tpi < 80 ? tpi + 1 : 8;
+  });
+
+  _benchmark("leadscrew_thread_metric", [&]() {
+    leadScrew.threadMetric(pitch);
+    pitch = pitch < 3 ? pitch + 0.25f : 0.5f;
+  });
+}
+
+void test_leadscrew_iteration() {
+  leadScrew.threadTPI(20);
+  leadScrew.engage(true);
+
+  _benchmark("leadscrew_iteration_idle", []() {
+    leadScrew._iterate();
+  });
+
+  _benchmark("leadscrew_iteration_sample", []() {
+    encoder.move(4);
+  }, []() {
+    leadScrew._iterate();
+  });
+
+  leadScrew.powerFeedIPR(0.005);
+  leadScrew.chipBreakRevolutions(0.25, 0.0625, 0);
+  leadScrew.chipBreaking(true);
+
+  _benchmark("leadscrew_iteration_chip_break", []() {
+    encoder.move(4);
+  }, []() {
+    leadScrew._iterate();
+  });
+
+  TEST_ASSERT_TRUE(leadScrew.chipBreaks() > 0);
+
+  leadScrew.chipBreaking(false);
+
+  leadScrew.engage(false);
+  leadScrew._iterate();
+}
+
+void test_stepper_loop() {
+  stepper.enabled(true);
+
+  _benchmark("stepper_loop", []() {
+    stepper.desiredPosition = stepper.position + 100;
+  }, []() {
+    stepper.loop();
+  });
+
+  stepper.enabled(false);
+}
+
+void test_tachometer_loop() {
+  _benchmark("tachometer_loop", []() {
+    encoder.move(4);
+  }, []() {
+    tachometer._loop();
+  });
+}
+
+/**
+ * @brief A feed fast enough to have more steps in flight than the
+ *        deadband, against a feedback count that trails the pulses.
+ *        Only steps that are really missed may be corrected.
+ */
+void test_feedback_lag() {
+  feedback.begin();
+
+  simulatedLeadScrew.feedPerMinute(30);
+  simulatedLeadScrew.engage(true);
+  simulatedLeadScrew.run(400000);
+
+  _benchmark("leadscrew_iteration_feedback", []() {
+    simulatedLeadScrew._iterate();
+  });
+
+  TEST_ASSERT_EQUAL_UINT32(0, simulatedLeadScrew.corrections());
+
+  feedback.missSteps(50);
+  simulatedLeadScrew.run(100000);
+
+  TEST_ASSERT_TRUE(simulatedLeadScrew.corrections() > 0);
+  TEST_ASSERT_EQUAL_UINT32(NoFault, simulatedLeadScrew.faults());
+
+  simulatedLeadScrew.engage(false);
+  simulatedLeadScrew.run(300000);
+}
+
+
+void setUp() {}
+void tearDown() {}
+
+int runBenchmarks() {
+  _startTimer();
+
+  // Measure the cost of reading the timer itself, which
+  // is then taken out of every measurement
+
+  _overhead = UINT32_MAX;
+
+  for (int i = 0; i < 100; i++) {
+    const uint32_t start = _readTimer();
+    _overhead = std::min(_overhead, _elapsed(start, _readTimer()));
+  }
+
+  flightRecorder.begin();
+  stepper.begin();
+  encoder.start();
+  leadScrew.begin();
+  tachometer.start();
+  simulatedLeadScrew.begin();
+
+  UNITY_BEGIN();
+  RUN_TEST(test_gray_to_binary);
+  RUN_TEST(test_decode_frame);
+  RUN_TEST(test_encoder_loop);
+  RUN_TEST(test_ratio);
+  RUN_TEST(test_leadscrew_iteration);
+  RUN_TEST(test_stepper_loop);
+  RUN_TEST(test_tachometer_loop);
+  RUN_TEST(test_feedback_lag);
+  return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup() {
+  // Give the serial port time to come up
+  delay(2000);
+
+  runBenchmarks();
+}
+
+void loop() {}
+#else // ARDUINO
+int main() {
+  return runBenchmarks();
+}
+#endif // ARDUINO